@@ -0,0 +1,493 @@
+#include "asset_loader.h"
+
+#include <util/threading.h>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+/* A decoded PNG and the file state it was decoded from. image is empty if
+ * the file was missing or failed to decode in that state. */
+struct decoded_image {
+	std::string path;
+	std::filesystem::file_time_type mtime;
+	cv::Mat image;
+};
+
+/* Decoded PNGs of one logo library, in the order of its file names. */
+struct library_images {
+	std::vector<std::string> names;
+	std::vector<decoded_image> templates;
+	std::vector<decoded_image> overlays;
+};
+
+struct asset_loader {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	bool stop = false;
+	bool has_request = false;
+	asset_params request;
+
+	asset_ready_callback callback = nullptr;
+	void *param = nullptr;
+
+	/* Only touched by the loader thread. Decoded PNGs per mapping, the
+	 * last bundle built, which the next build reuses stages of, and the
+	 * last one handed to the callback. They differ while a bundle built
+	 * for a superseded request waits to be published. */
+	std::vector<decoded_image> template_src;
+	std::vector<decoded_image> overlay_src;
+	std::vector<library_images> library_src;
+	std::shared_ptr<const overlay_assets> current;
+	std::shared_ptr<const overlay_assets> published;
+};
+
+static cv::Mat load_template_gray(const std::string &path)
+{
+	if (path.empty()) {
+		return cv::Mat();
+	}
+
+	cv::Mat img = cv::imread(path, cv::IMREAD_GRAYSCALE);
+	return img;
+}
+
+static cv::Mat load_overlay_bgra(const std::string &path)
+{
+	if (path.empty()) {
+		return cv::Mat();
+	}
+
+	cv::Mat img = cv::imread(path, cv::IMREAD_UNCHANGED);
+	if (img.empty()) {
+		return img;
+	}
+
+	if (img.channels() == 4) {
+		return img;
+	}
+
+	cv::Mat converted;
+	if (img.channels() == 3) {
+		cv::cvtColor(img, converted, cv::COLOR_BGR2BGRA);
+	} else if (img.channels() == 1) {
+		cv::cvtColor(img, converted, cv::COLOR_GRAY2BGRA);
+	} else {
+		return cv::Mat();
+	}
+
+	return converted;
+}
+
+/* Decodes the file again if its path or modification time changed.
+ * Returns true if the image was replaced. A file that is missing or fails
+ * to decode is not tried again until it appears or is rewritten, so each
+ * settings change does not repeat the attempt and its warning. */
+static bool refresh_image(decoded_image *src, const std::string &path,
+		cv::Mat (*load)(const std::string &))
+{
+	std::error_code ec;
+	std::filesystem::file_time_type mtime = path.empty()
+			? std::filesystem::file_time_type()
+			: std::filesystem::last_write_time(std::filesystem::u8path(path), ec);
+	if (ec) {
+		mtime = std::filesystem::file_time_type();
+	}
+
+	if (src->path == path && src->mtime == mtime) {
+		return false;
+	}
+
+	src->path = path;
+	src->mtime = mtime;
+	src->image = load(path);
+	return true;
+}
+
+static bool same_template_params(const asset_params &a, const asset_params &b)
+{
+	return a.pyramid_levels == b.pyramid_levels && a.detect_downscale == b.detect_downscale &&
+			a.scale_min == b.scale_min && a.scale_max == b.scale_max &&
+			a.scale_step == b.scale_step && a.angle_range == b.angle_range &&
+			a.angle_step == b.angle_step;
+}
+
+/* Size of the template at a variant's scale in frame pixels. Variant
+ * geometry is in detection pixels, which differ with a downscale. */
+static cv::Size frame_template_size(const cv::Mat &template_gray, const template_variant &variant)
+{
+	return cv::Size(static_cast<int>(std::lround(template_gray.cols * variant.scale)),
+			static_cast<int>(std::lround(template_gray.rows * variant.scale)));
+}
+
+/* Overlay at one template scale. With scale_overlay the overlay follows the
+ * scaled template size, otherwise the original overlay is scaled by the same
+ * factor. Resampled once from the source PNG. */
+static cv::Mat scale_overlay(const cv::Mat &overlay_bgra, const cv::Mat &overlay_draw,
+		const cv::Mat &template_gray, const template_variant &variant, bool scale_to_template)
+{
+	if (overlay_bgra.empty()) {
+		return cv::Mat();
+	}
+
+	cv::Size size;
+	if (scale_to_template) {
+		size = frame_template_size(template_gray, variant);
+	} else {
+		size = cv::Size(static_cast<int>(std::lround(overlay_bgra.cols * variant.scale)),
+				static_cast<int>(std::lround(overlay_bgra.rows * variant.scale)));
+	}
+
+	if (size == overlay_draw.size()) {
+		return overlay_draw;
+	}
+	if (size.width < 1 || size.height < 1) {
+		return cv::Mat();
+	}
+
+	cv::Mat scaled;
+	const bool shrink = size.width < overlay_bgra.cols || size.height < overlay_bgra.rows;
+	cv::resize(overlay_bgra, scaled, size, 0.0, 0.0, shrink ? cv::INTER_AREA : cv::INTER_LINEAR);
+	return scaled;
+}
+
+/* Rotates the scaled overlay about the template centre, the same pivot the
+ * template variant was rotated about, so both stay aligned. The overlay's
+ * unrotated top-left shares the template's, as in the 1:1 case. */
+static overlay_variant rotate_overlay(const cv::Mat &scaled, const cv::Mat &template_gray,
+		const template_variant &variant, int downscale)
+{
+	overlay_variant out;
+	out.anchor = cv::Point(0, 0);
+
+	if (scaled.empty() || variant.angle == 0.0f) {
+		out.image = scaled;
+		return out;
+	}
+
+	const cv::Size templ_size = frame_template_size(template_gray, variant);
+	const cv::Point2f pivot(templ_size.width * 0.5f, templ_size.height * 0.5f);
+	cv::Point2f origin;
+	rotate_image(scaled, pivot, variant.angle, cv::INTER_LINEAR, out.image, &origin);
+
+	out.anchor = cv::Point(static_cast<int>(std::lround(origin.x - variant.origin.x * downscale)),
+			static_cast<int>(std::lround(origin.y - variant.origin.y * downscale)));
+	return out;
+}
+
+/* Builds one template -> overlay pair, redoing only the stages whose
+ * inputs changed since the previous build of it: decode, overlay resize,
+ * template bank, overlay variants, blend preparation. Returns the previous
+ * pair itself if nothing changed, so settings that only affect detection or
+ * placement cost no work here. */
+static std::shared_ptr<const mapping_assets> build_pair(decoded_image *template_src,
+		decoded_image *overlay_src, const mapping_paths &paths, const asset_params &params,
+		const asset_params *prev_params, const std::shared_ptr<const mapping_assets> &prev_mapping)
+{
+	const bool template_changed = refresh_image(template_src, paths.template_path,
+			load_template_gray);
+	const bool overlay_changed = refresh_image(overlay_src, paths.overlay_path,
+			load_overlay_bgra);
+
+	const mapping_assets *prev = prev_params && prev_mapping && !prev_mapping->library
+			? prev_mapping.get() : nullptr;
+	const bool rebuild_templates = !prev || template_changed ||
+			!same_template_params(*prev_params, params);
+	const bool rebuild_draw = !prev || template_changed || overlay_changed ||
+			prev_params->scale_overlay != params.scale_overlay;
+	const bool rebuild_prepared = rebuild_templates || rebuild_draw ||
+			prev_params->opacity != params.opacity;
+
+	if (!rebuild_prepared) {
+		return prev_mapping;
+	}
+
+	auto assets = std::make_shared<mapping_assets>();
+	assets->template_gray = template_src->image;
+	assets->overlay_bgra = overlay_src->image;
+
+	if (!rebuild_draw) {
+		assets->overlay_draw = prev->overlay_draw;
+	} else if (!assets->overlay_bgra.empty() && params.scale_overlay &&
+			!assets->template_gray.empty()) {
+		cv::resize(assets->overlay_bgra, assets->overlay_draw,
+				cv::Size(assets->template_gray.cols, assets->template_gray.rows),
+				0.0, 0.0, cv::INTER_AREA);
+	} else {
+		assets->overlay_draw = assets->overlay_bgra;
+	}
+
+	if (!rebuild_templates) {
+		assets->templates = prev->templates;
+	} else {
+		auto templates = std::make_shared<template_bank>();
+		build_template_bank(assets->template_gray, params.scale_min, params.scale_max,
+				params.scale_step, params.angle_range, params.angle_step,
+				params.pyramid_levels, params.detect_downscale, *templates);
+		assets->templates = templates;
+	}
+
+	if (!rebuild_templates && !rebuild_draw) {
+		/* Only the opacity changed: keep the warped images. */
+		for (const overlay_variant &prev_variant : prev->overlay_variants) {
+			overlay_variant variant;
+			variant.image = prev_variant.image;
+			variant.anchor = prev_variant.anchor;
+			assets->overlay_variants.push_back(std::move(variant));
+		}
+	} else {
+		const template_bank &templates = *assets->templates;
+		cv::Mat scaled;
+		for (size_t i = 0; i < templates.size(); ++i) {
+			const template_variant &variant = templates.variants[i];
+			if (i % templates.angle_count == 0) {
+				scaled = scale_overlay(assets->overlay_bgra, assets->overlay_draw,
+						assets->template_gray, variant, params.scale_overlay);
+			}
+			assets->overlay_variants.push_back(rotate_overlay(scaled, assets->template_gray,
+					variant, templates.downscale));
+		}
+	}
+
+	for (overlay_variant &variant : assets->overlay_variants) {
+		prepare_overlay(variant.image, params.opacity, &variant.prepared);
+	}
+
+	return assets;
+}
+
+static bool is_directory(const std::string &path)
+{
+	std::error_code ec;
+	return !path.empty() && std::filesystem::is_directory(std::filesystem::u8path(path), ec);
+}
+
+/* Names of the PNGs in the template folder that have an overlay of the
+ * same name, sorted. */
+static std::vector<std::string> list_library(const mapping_paths &paths)
+{
+	std::vector<std::string> names;
+	std::error_code ec;
+	const std::filesystem::path overlay_dir = std::filesystem::u8path(paths.overlay_path);
+	for (std::filesystem::directory_iterator it(std::filesystem::u8path(paths.template_path), ec), end;
+			!ec && it != end; it.increment(ec)) {
+		const std::filesystem::path &file = it->path();
+		std::string extension = file.extension().u8string();
+		std::transform(extension.begin(), extension.end(), extension.begin(),
+				[](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+		std::error_code file_ec;
+		if (extension == ".png" && it->is_regular_file(file_ec) &&
+				std::filesystem::is_regular_file(overlay_dir / file.filename(), file_ec)) {
+			names.push_back(file.filename().u8string());
+		}
+	}
+
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+/* Builds a logo library: every logo like a plain pair, reusing the decoded
+ * PNGs and the pair of the same name from the previous build, then the
+ * index over their templates, rebuilt only if any of them changed. Logos
+ * whose PNGs cannot be used are left out. */
+static std::shared_ptr<const mapping_assets> build_library(library_images *src,
+		const mapping_paths &paths, const asset_params &params, const asset_params *prev_params,
+		const std::shared_ptr<const mapping_assets> &prev_mapping)
+{
+	const logo_library *prev = prev_params && prev_mapping ? prev_mapping->library.get() : nullptr;
+	const std::filesystem::path template_dir = std::filesystem::u8path(paths.template_path);
+	const std::filesystem::path overlay_dir = std::filesystem::u8path(paths.overlay_path);
+
+	library_images next;
+	next.names = list_library(paths);
+	next.templates.resize(next.names.size());
+	next.overlays.resize(next.names.size());
+
+	auto library = std::make_shared<logo_library>();
+	std::vector<std::shared_ptr<const template_bank>> banks;
+	bool changed = !prev;
+
+	for (size_t i = 0; i < next.names.size(); ++i) {
+		const std::string &name = next.names[i];
+		const auto cached = std::lower_bound(src->names.begin(), src->names.end(), name);
+		if (cached != src->names.end() && *cached == name) {
+			const size_t at = static_cast<size_t>(cached - src->names.begin());
+			next.templates[i] = std::move(src->templates[at]);
+			next.overlays[i] = std::move(src->overlays[at]);
+		}
+
+		static const std::shared_ptr<const mapping_assets> none;
+		const std::shared_ptr<const mapping_assets> *prev_entry = &none;
+		if (prev) {
+			const auto found = std::lower_bound(prev->names.begin(), prev->names.end(), name);
+			if (found != prev->names.end() && *found == name) {
+				prev_entry = &prev->entries[static_cast<size_t>(found - prev->names.begin())];
+			}
+		}
+
+		const mapping_paths entry_paths = {(template_dir / std::filesystem::u8path(name)).u8string(),
+				(overlay_dir / std::filesystem::u8path(name)).u8string()};
+		std::shared_ptr<const mapping_assets> entry = build_pair(&next.templates[i],
+				&next.overlays[i], entry_paths, params, prev_entry->get() ? prev_params : nullptr,
+				*prev_entry);
+		if (!entry->usable()) {
+			continue;
+		}
+
+		changed = changed || entry != *prev_entry;
+		library->names.push_back(name);
+		banks.push_back(entry->templates);
+		library->entries.push_back(std::move(entry));
+	}
+
+	*src = std::move(next);
+
+	if (!changed && prev->entries.size() == library->entries.size()) {
+		return prev_mapping;
+	}
+
+	if (prev && prev->index->banks == banks) {
+		library->index = prev->index;
+	} else {
+		auto index = std::make_shared<logo_index>();
+		build_logo_index(std::move(banks), *index);
+		library->index = index;
+	}
+
+	auto assets = std::make_shared<mapping_assets>();
+	assets->library = library;
+	return assets;
+}
+
+/* Builds mapping `index` as a plain pair or a library, by what its paths
+ * point at. */
+static std::shared_ptr<const mapping_assets> build_mapping(asset_loader *loader, size_t index,
+		const asset_params &params, const asset_params *prev_params,
+		const std::shared_ptr<const mapping_assets> &prev_mapping)
+{
+	const mapping_paths &paths = params.mappings[index];
+	if (is_directory(paths.template_path) && is_directory(paths.overlay_path)) {
+		return build_library(&loader->library_src[index], paths, params, prev_params,
+				prev_mapping);
+	}
+
+	loader->library_src[index] = library_images();
+	return build_pair(&loader->template_src[index], &loader->overlay_src[index], paths, params,
+			prev_params, prev_mapping);
+}
+
+/* Builds the bundle for params mapping by mapping. Returns the previous
+ * bundle itself if no mapping changed. */
+static std::shared_ptr<const overlay_assets> build_assets(asset_loader *loader,
+		const asset_params &params)
+{
+	const overlay_assets *prev = loader->current.get();
+	const size_t count = params.mappings.size();
+	loader->template_src.resize(count);
+	loader->overlay_src.resize(count);
+	loader->library_src.resize(count);
+
+	auto assets = std::make_shared<overlay_assets>();
+	assets->params = params;
+
+	bool changed = !prev || prev->mappings.size() != count;
+	for (size_t i = 0; i < count; ++i) {
+		static const std::shared_ptr<const mapping_assets> none;
+		const bool has_prev = prev && i < prev->mappings.size();
+		const std::shared_ptr<const mapping_assets> &prev_mapping =
+				has_prev ? prev->mappings[i] : none;
+
+		assets->mappings.push_back(build_mapping(loader, i, params,
+				has_prev ? &prev->params : nullptr, prev_mapping));
+		changed = changed || assets->mappings.back() != prev_mapping;
+	}
+
+	if (!changed) {
+		return loader->current;
+	}
+
+	loader->current = assets;
+	return assets;
+}
+
+static void loader_thread(asset_loader *loader)
+{
+	os_set_thread_name("shape-overlay: load");
+
+	std::unique_lock<std::mutex> lock(loader->mutex);
+
+	for (;;) {
+		loader->cond.wait(lock, [loader] { return loader->stop || loader->has_request; });
+		if (loader->stop) {
+			break;
+		}
+
+		const asset_params params = loader->request;
+		loader->has_request = false;
+		lock.unlock();
+
+		std::shared_ptr<const overlay_assets> assets = build_assets(loader, params);
+
+		lock.lock();
+
+		/* Nothing to publish if the filter already has this bundle, or if a
+		 * newer request supersedes it before anyone saw it. Compared with
+		 * the last published bundle, not the last built one, so a request
+		 * that changes nothing since a superseded build still publishes
+		 * that build. */
+		if (assets != loader->published && !loader->has_request && !loader->stop) {
+			loader->published = assets;
+			lock.unlock();
+			loader->callback(loader->param, std::move(assets));
+			lock.lock();
+		}
+	}
+}
+
+asset_loader *asset_loader_create(asset_ready_callback callback, void *param)
+{
+	asset_loader *loader = new asset_loader();
+	loader->callback = callback;
+	loader->param = param;
+	loader->thread = std::thread(loader_thread, loader);
+	return loader;
+}
+
+void asset_loader_destroy(asset_loader *loader)
+{
+	if (!loader) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(loader->mutex);
+		loader->stop = true;
+	}
+	loader->cond.notify_one();
+
+	if (loader->thread.joinable()) {
+		loader->thread.join();
+	}
+	delete loader;
+}
+
+void asset_loader_request(asset_loader *loader, const asset_params &params)
+{
+	{
+		std::lock_guard<std::mutex> lock(loader->mutex);
+		loader->request = params;
+		loader->has_request = true;
+	}
+	loader->cond.notify_one();
+}
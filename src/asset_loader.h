@@ -0,0 +1,114 @@
+#pragma once
+
+#include "logo_index.h"
+#include "overlay_blend.h"
+#include "template_match.h"
+
+#include <opencv2/core.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/* The PNGs of one template -> overlay mapping. If both paths are folders
+ * the mapping is a logo library: every PNG in the template folder that has
+ * a PNG of the same name in the overlay folder is one logo. */
+struct mapping_paths {
+	std::string template_path;
+	std::string overlay_path;
+};
+
+/* Settings that the loaded images and everything derived from them
+ * depend on. Everything but the paths is shared by all mappings. */
+struct asset_params {
+	std::vector<mapping_paths> mappings;
+	bool scale_overlay;
+	int pyramid_levels;
+	int detect_downscale;
+	float scale_min;
+	float scale_max;
+	float scale_step;
+	float angle_range;
+	float angle_step;
+	float opacity;
+};
+
+/* Overlay pre-warped for one template bank variant. anchor is the offset of
+ * the image's top-left corner from the match position; prepared is the
+ * image ready to blend at the current opacity. */
+struct overlay_variant {
+	cv::Mat image;
+	cv::Point anchor;
+	prepared_overlay prepared;
+};
+
+struct mapping_assets;
+
+/* The logos of a library mapping, sorted by file name, and the index that
+ * identifies them. index->banks[i] is entries[i]->templates. */
+struct logo_library {
+	std::vector<std::string> names;
+	std::vector<std::shared_ptr<const mapping_assets>> entries;
+	std::shared_ptr<const logo_index> index;
+};
+
+/* Decoded images and derived data of one mapping. A library mapping has
+ * only `library` set; each of its entries is a plain mapping. */
+struct mapping_assets {
+	cv::Mat template_gray;
+	cv::Mat overlay_bgra;
+	cv::Mat overlay_draw;
+
+	std::shared_ptr<const template_bank> templates;
+	std::vector<overlay_variant> overlay_variants;
+
+	std::shared_ptr<const logo_library> library;
+
+	/* A template to search for and an overlay to draw. */
+	bool usable() const
+	{
+		if (library) {
+			return library->index && !library->index->empty();
+		}
+		return templates && !templates->empty() && !overlay_variants.empty() &&
+				!overlay_variants[0].image.empty();
+	}
+
+	/* Identifies the templates detection results refer to. Only valid for
+	 * usable mappings, as is downscale. */
+	uint64_t generation() const
+	{
+		return library ? library->index->generation : templates->generation;
+	}
+
+	int downscale() const
+	{
+		return library ? library->index->banks[0]->downscale : templates->downscale;
+	}
+};
+
+/* Decoded images and derived data for one set of asset_params, one entry
+ * per mapping in the same order. Immutable once published, so readers can
+ * keep using a bundle after a newer one has been swapped in; mappings whose
+ * inputs did not change are shared with the previous bundle. */
+struct overlay_assets {
+	asset_params params;
+	std::vector<std::shared_ptr<const mapping_assets>> mappings;
+};
+
+/* Called on the loader thread with each finished bundle. */
+typedef void (*asset_ready_callback)(void *param, std::shared_ptr<const overlay_assets> assets);
+
+struct asset_loader;
+
+asset_loader *asset_loader_create(asset_ready_callback callback, void *param);
+
+/* Stops the thread, waiting for a running load to finish. No callback runs
+ * after this returns. */
+void asset_loader_destroy(asset_loader *loader);
+
+/* Queues a load. Only the newest request is kept. An image whose path and
+ * modification time are unchanged is not decoded again, and derived data is
+ * rebuilt only for the stages whose inputs changed. If nothing changed no
+ * bundle is published. */
+void asset_loader_request(asset_loader *loader, const asset_params &params);
@@ -0,0 +1,408 @@
+#include "detection_worker.h"
+#include "tile_pool.h"
+
+#include <util/base.h>
+#include <util/platform.h>
+#include <util/threading.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Most detection threads the pool starts, however many cores there are. */
+static constexpr unsigned SCHEDULER_MAX_THREADS = 4;
+
+/* Library logos verified at full resolution when identifying, most
+ * similar first. The first one usually is the logo; the runner-up covers
+ * look-alikes that only differ in detail. */
+static constexpr size_t LOGO_VERIFY_CANDIDATES = 2;
+
+struct detection_worker {
+	/* Guarded by the scheduler mutex. */
+	bool queued = false;
+	bool running = false;
+	uint64_t queue_order = 0;
+	detection_job job;
+
+	/* Set by submit, cleared once the result is published. Results go to
+	 * results[seq & 1] before result_seq is bumped to seq. The next result
+	 * only starts after the next submit, which the caller makes after
+	 * polling, so the slot being written is never the one the newest
+	 * result_seq points readers at. */
+	std::atomic<bool> busy{false};
+	std::atomic<uint64_t> result_seq{0};
+	detection_result results[2] = {};
+
+	/* Only touched by the pool thread running this worker's job. */
+	match_workspace workspace;
+	logo_workspace logos;
+};
+
+/* One pool for every filter in the process. Queued workers run in
+ * priority order, oldest submission first within a priority. The budget
+ * is a token bucket of nanoseconds: it refills at budget_ms_per_sec up to
+ * burst_ns, each detection pays its CPU time afterwards, and new jobs start
+ * only while it is positive. */
+struct detection_scheduler {
+	std::mutex mutex;
+	std::condition_variable work;
+	std::condition_variable finished;
+	std::vector<std::thread> threads;
+
+	bool stop = false;
+	std::vector<detection_worker *> queue;
+	uint64_t next_order = 0;
+
+	int64_t budget_ms_per_sec = 0;
+	int64_t burst_ns = 0;
+	int64_t budget_ns = 0;
+	uint64_t budget_ts = 0;
+};
+
+static detection_scheduler *scheduler = nullptr;
+
+/* Looks for a target in its tracking window. The window lies within the
+ * job's region, which the caller sized to cover it. */
+static bool search_window(match_workspace *ws, const detection_job &job,
+		const detection_target &target, template_match *out)
+{
+	if (!target.templates || target.max_instances > 1) {
+		return false;
+	}
+
+	const template_bank &templates = *target.templates;
+	if (job.tracking_margin <= 0 || !target.last_valid || target.last_variant >= templates.size()) {
+		return false;
+	}
+
+	const cv::Size templ_size = templates.variants[target.last_variant].pyramid[0].size();
+	cv::Rect window = tracking_window(target.last_x, target.last_y, templ_size,
+			job.tracking_margin, job.frame_size);
+	window &= job.region;
+	if (window.width < templ_size.width || window.height < templ_size.height) {
+		return false;
+	}
+
+	const cv::Rect local(window.x - job.region.x, window.y - job.region.y,
+			window.width, window.height);
+	return detect_template_window(ws, job.frame_gray(local), window, templates,
+			target.last_variant, target.threshold, out);
+}
+
+/* Pyramid levels a full-frame search for the target needs. */
+static size_t target_levels(const detection_target &target)
+{
+	size_t levels = target.templates ? template_bank_levels(*target.templates) : 0;
+	if (target.library) {
+		levels = std::max(levels, logo_index_levels(*target.library));
+	}
+	return levels;
+}
+
+/* Finds which library logo is in the frame prepared by match_begin_frame:
+ * the library is ranked at the most logo-like spot and the best candidates
+ * are verified at full resolution around it. */
+static bool identify_target(match_workspace *ws, logo_workspace *lw, const detection_job &job,
+		const detection_target &target, detection_target_result *res)
+{
+	const logo_index &library = *target.library;
+	logo_candidate candidates[LOGO_VERIFY_CANDIDATES];
+	const size_t count = identify_logo(*ws, lw, library, candidates, LOGO_VERIFY_CANDIDATES);
+
+	for (size_t i = 0; i < count; ++i) {
+		const logo_candidate &candidate = candidates[i];
+		template_match match = {0, 0, 0.0f, 0};
+		const bool matched = detect_template_window(ws, job.frame_gray(candidate.window),
+				candidate.window, *library.banks[candidate.entry],
+				library.reference_variant[candidate.entry], target.threshold, &match);
+		if (matched || match.score > res->match.score) {
+			res->match = match;
+			res->library_entry = candidate.entry;
+		}
+		if (matched) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void run_detection(match_workspace *ws, logo_workspace *lw, const detection_job &job,
+		detection_result *out)
+{
+	const bool full_frame = job.region.size() == job.frame_size;
+
+	out->target_count = job.target_count;
+	out->needs_full_frame = false;
+
+	/* Tracking windows first; whatever they miss gets a full-frame search,
+	 * all targets sharing one frame preparation. */
+	size_t levels = 0;
+	for (size_t i = 0; i < job.target_count; ++i) {
+		const detection_target &target = job.targets[i];
+		detection_target_result &res = out->targets[i];
+		res.mapping = target.mapping;
+		res.generation = target.library ? target.library->generation
+				: target.templates->generation;
+		res.library_entry = target.library_entry;
+		res.match = {0, 0, 0.0f, 0};
+		res.matched = search_window(ws, job, target, &res.match);
+		res.searched = res.matched || full_frame;
+		res.instances[0] = res.match;
+		res.instance_count = res.matched ? 1 : 0;
+
+		if (!res.matched) {
+			levels = std::max(levels, target_levels(target));
+		}
+	}
+
+	if (levels == 0) {
+		return;
+	}
+
+	if (!full_frame) {
+		out->needs_full_frame = true;
+		return;
+	}
+
+	ws->engine = job.engine;
+	ws->threads = job.match_threads;
+	match_begin_frame(ws, job.frame_gray, levels);
+	for (size_t i = 0; i < job.target_count; ++i) {
+		const detection_target &target = job.targets[i];
+		detection_target_result &res = out->targets[i];
+		if (!res.matched && target.templates && target.max_instances > 1) {
+			res.instance_count = detect_template_instances(ws, *target.templates,
+					target.threshold, std::min<size_t>(target.max_instances,
+							DETECTION_MAX_INSTANCES), res.instances);
+			res.matched = res.instance_count > 0;
+			if (res.matched) {
+				res.match = res.instances[0];
+			}
+		} else if (!res.matched && target.templates) {
+			res.matched = detect_template(ws, *target.templates, target.threshold, &res.match);
+		}
+		if (!res.matched && target.library) {
+			res.matched = identify_target(ws, lw, job, target, &res);
+		}
+		if (res.matched && res.instance_count == 0) {
+			res.instances[0] = res.match;
+			res.instance_count = 1;
+		}
+	}
+	match_end_frame(ws);
+}
+
+static void refill_budget(detection_scheduler *sched, uint64_t now)
+{
+	/* Capped before scaling: once the bucket is full, longer idle
+	 * stretches add nothing, and the product cannot overflow. */
+	const int64_t elapsed_ns = static_cast<int64_t>(std::min<uint64_t>(now - sched->budget_ts,
+			static_cast<uint64_t>(sched->burst_ns)));
+	sched->budget_ts = now;
+	sched->budget_ns = std::min(sched->budget_ns + elapsed_ns * sched->budget_ms_per_sec / 1000,
+			sched->burst_ns);
+}
+
+static std::vector<detection_worker *>::iterator next_queued(detection_scheduler *sched)
+{
+	return std::min_element(sched->queue.begin(), sched->queue.end(),
+			[](const detection_worker *a, const detection_worker *b) {
+				if (a->job.priority != b->job.priority) {
+					return a->job.priority < b->job.priority;
+				}
+				return a->queue_order < b->queue_order;
+			});
+}
+
+static void pool_thread(detection_scheduler *sched)
+{
+	os_set_thread_name("shape-overlay: detect");
+
+	std::unique_lock<std::mutex> lock(sched->mutex);
+
+	for (;;) {
+		sched->work.wait(lock, [sched] { return sched->stop || !sched->queue.empty(); });
+		if (sched->stop) {
+			break;
+		}
+
+		/* Every priority needs the same budget, so if the first job in
+		 * line cannot start yet, none of the others can either. */
+		auto next = next_queued(sched);
+		refill_budget(sched, os_gettime_ns());
+		if (sched->budget_ns <= 0) {
+			const int64_t wait_ns = -sched->budget_ns * 1000 / sched->budget_ms_per_sec + 1000000;
+			sched->work.wait_for(lock, std::chrono::nanoseconds(wait_ns));
+			continue;
+		}
+
+		detection_worker *worker = *next;
+		sched->queue.erase(next);
+		worker->queued = false;
+		worker->running = true;
+		detection_job job = std::move(worker->job);
+		lock.unlock();
+
+		const uint64_t start_ts = os_gettime_ns();
+		detection_result result;
+		worker->workspace.helper_ns = 0;
+		run_detection(&worker->workspace, &worker->logos, job, &result);
+		const uint64_t end_ts = os_gettime_ns();
+		result.start_ts = start_ts;
+		result.duration_ns = end_ts - start_ts;
+		result.cpu_ns = result.duration_ns + worker->workspace.helper_ns;
+
+		/* Release the frame and template references outside the lock, and
+		 * before clearing busy: the submitter reuses the frame buffer. */
+		job = detection_job();
+
+		const uint64_t seq = worker->result_seq.load(std::memory_order_relaxed) + 1;
+		worker->results[seq & 1] = result;
+		worker->result_seq.store(seq, std::memory_order_release);
+		worker->busy.store(false, std::memory_order_release);
+
+		lock.lock();
+		sched->budget_ns -= static_cast<int64_t>(result.cpu_ns);
+		worker->running = false;
+		sched->finished.notify_all();
+	}
+}
+
+void detection_scheduler_start(const detection_scheduler_config &config)
+{
+	if (scheduler) {
+		return;
+	}
+
+	const unsigned cores = std::max(std::thread::hardware_concurrency(), 2u);
+	const unsigned count = std::min(cores / 2, SCHEDULER_MAX_THREADS);
+
+	tile_pool_start();
+
+	scheduler = new detection_scheduler();
+	/* The bounds keep refill_budget's product within 64 bits. */
+	scheduler->budget_ms_per_sec = std::clamp<int64_t>(config.budget_ms_per_sec, 1, 64000);
+	scheduler->burst_ns = std::clamp<int64_t>(config.budget_burst_ms, 1, 60000) * 1000000;
+	scheduler->budget_ns = scheduler->burst_ns;
+	blog(LOG_INFO, "[shape-overlay] %u detection threads, budget of %lld ms per second, bursts of %lld ms",
+			count, static_cast<long long>(scheduler->budget_ms_per_sec),
+			static_cast<long long>(scheduler->burst_ns / 1000000));
+	scheduler->budget_ts = os_gettime_ns();
+	for (unsigned i = 0; i < count; ++i) {
+		scheduler->threads.emplace_back(pool_thread, scheduler);
+	}
+}
+
+void detection_scheduler_stop(void)
+{
+	if (!scheduler) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(scheduler->mutex);
+		scheduler->stop = true;
+	}
+	scheduler->work.notify_all();
+
+	for (std::thread &thread : scheduler->threads) {
+		thread.join();
+	}
+	delete scheduler;
+	scheduler = nullptr;
+
+	/* After the jobs: a running detection may still be using it. */
+	tile_pool_stop();
+}
+
+/* Takes a queued worker off the queue. Called with the scheduler locked. */
+static void unqueue(detection_scheduler *sched, detection_worker *worker)
+{
+	if (worker->queued) {
+		sched->queue.erase(std::find(sched->queue.begin(), sched->queue.end(), worker));
+		worker->queued = false;
+	}
+}
+
+detection_worker *detection_worker_create(void)
+{
+	return new detection_worker();
+}
+
+void detection_worker_destroy(detection_worker *worker)
+{
+	if (!worker) {
+		return;
+	}
+
+	if (scheduler) {
+		std::unique_lock<std::mutex> lock(scheduler->mutex);
+		unqueue(scheduler, worker);
+		scheduler->finished.wait(lock, [worker] { return !worker->running; });
+	}
+
+	delete worker;
+}
+
+bool detection_worker_busy(detection_worker *worker)
+{
+	return worker->busy.load(std::memory_order_acquire);
+}
+
+bool detection_worker_submit(detection_worker *worker, detection_job &&job)
+{
+	if (!scheduler || worker->busy.load(std::memory_order_acquire)) {
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(scheduler->mutex);
+		if (scheduler->stop) {
+			return false;
+		}
+
+		worker->job = std::move(job);
+		worker->queued = true;
+		worker->queue_order = scheduler->next_order++;
+		worker->busy.store(true, std::memory_order_relaxed);
+		scheduler->queue.push_back(worker);
+	}
+	scheduler->work.notify_one();
+	return true;
+}
+
+void detection_worker_cancel(detection_worker *worker)
+{
+	if (!scheduler) {
+		return;
+	}
+
+	detection_job dropped;
+	{
+		std::lock_guard<std::mutex> lock(scheduler->mutex);
+		if (!worker->queued) {
+			return;
+		}
+		unqueue(scheduler, worker);
+		dropped = std::move(worker->job);
+	}
+
+	dropped = detection_job();
+	worker->busy.store(false, std::memory_order_release);
+}
+
+bool detection_worker_poll(detection_worker *worker, uint64_t *seq, detection_result *out)
+{
+	const uint64_t current = worker->result_seq.load(std::memory_order_acquire);
+	if (current == *seq) {
+		return false;
+	}
+
+	*seq = current;
+	*out = worker->results[current & 1];
+	return true;
+}
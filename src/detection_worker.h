@@ -0,0 +1,149 @@
+#pragma once
+
+#include "logo_index.h"
+#include "template_match.h"
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/* Most template -> overlay mappings one filter can detect at once. Jobs
+ * and results hold them in fixed arrays, so handing them over allocates
+ * nothing. */
+#define DETECTION_MAX_MAPPINGS 8
+
+/* Most copies of one template a detection reports. */
+#define DETECTION_MAX_INSTANCES 16
+
+/* Order in which queued detections get the shared pool and its budget. */
+enum detection_priority {
+	/* The source is on program: what viewers see. */
+	DETECTION_PRIORITY_PROGRAM,
+	/* Shown somewhere, e.g. preview or a projector, but not on program.
+	 * Sources shown nowhere are paused and submit nothing. */
+	DETECTION_PRIORITY_PREVIEW,
+};
+
+/* Detection time all filters together may use per second, in milliseconds
+ * of one core (1000 is one core's worth), and the burst the budget can save
+ * up while detection is idle. */
+#define DETECTION_DEFAULT_BUDGET_MS_PER_SEC 1000
+#define DETECTION_DEFAULT_BUDGET_BURST_MS 1000
+
+struct detection_scheduler_config {
+	int64_t budget_ms_per_sec = DETECTION_DEFAULT_BUDGET_MS_PER_SEC;
+	int64_t budget_burst_ms = DETECTION_DEFAULT_BUDGET_BURST_MS;
+};
+
+/* One template bank to look for, and where it was last found. mapping is
+ * the caller's index for it, passed back in the result. For a logo library
+ * `library` is set and templates is the bank of library_entry, the logo
+ * identified last, or null before the first one; when that logo is not
+ * found in a full-frame search, the library is searched instead. */
+struct detection_target {
+	size_t mapping;
+	std::shared_ptr<const template_bank> templates;
+	std::shared_ptr<const logo_index> library;
+	size_t library_entry;
+	float threshold;
+	/* Copies to look for; above 1 the target is always searched in the
+	 * whole frame, as tracking windows only follow a single match. */
+	size_t max_instances;
+
+	bool last_valid;
+	int last_x;
+	int last_y;
+	size_t last_variant;
+};
+
+/* Everything one detection needs, copied out of the filter so the worker
+ * never touches filter state. frame_gray covers `region` of the frame only:
+ * the whole frame for a full search, or just the area around the tracking
+ * windows of the last matches when only those need checking. All targets
+ * are searched in the same gray frame, pyramid and FFT frame data. Sizes
+ * and positions are in detection pixels (frame pixels / downscale); every
+ * bank of a job has the same downscale. The worker lets go of frame_gray
+ * before it stops being busy, so it may be a view of a buffer the caller
+ * refills for the next job. */
+struct detection_job {
+	cv::Mat frame_gray;
+	cv::Rect region;
+	cv::Size frame_size;
+
+	detection_target targets[DETECTION_MAX_MAPPINGS];
+	size_t target_count;
+
+	detection_priority priority;
+	int tracking_margin;
+	match_engine engine;
+	/* Threads one large spatial search may use, see match_workspace. */
+	unsigned match_threads;
+};
+
+/* Outcome for one target. generation is its bank's, or its library's, so
+ * results for templates replaced since can be told apart. library_entry is
+ * the library logo the match belongs to. searched is false for targets
+ * whose tracking window came up empty in a windowed job: they wait for the
+ * full-frame search instead. */
+struct detection_target_result {
+	size_t mapping;
+	uint64_t generation;
+	size_t library_entry;
+	bool searched;
+	bool matched;
+	template_match match;
+	/* Every copy found, strongest first; instances[0] is match. */
+	template_match instances[DETECTION_MAX_INSTANCES];
+	size_t instance_count;
+};
+
+struct detection_result {
+	detection_target_result targets[DETECTION_MAX_MAPPINGS];
+	size_t target_count;
+	/* The job only covered tracking windows and something was not found in
+	 * its window; the next job should carry the whole frame. */
+	bool needs_full_frame;
+	/* os_gettime_ns() when the detection started running, and its wall time. */
+	uint64_t start_ts;
+	uint64_t duration_ns;
+	/* CPU time it took: its wall time plus what tile pool threads spent
+	 * helping it. */
+	uint64_t cpu_ns;
+};
+
+/* Starts and stops the plugin-wide thread pool that runs the jobs of every
+ * worker, from module load and unload, along with the tile pool the jobs
+ * split large searches across. The pool has up to half as many threads as
+ * there are cores (at most 4) and shares config's budget of detection time
+ * per second between all filters, tile pool time included. */
+void detection_scheduler_start(const detection_scheduler_config &config);
+void detection_scheduler_stop(void);
+
+/* One filter's handle on the pool: at most one job in flight, its result,
+ * and the match workspace its detections reuse. */
+struct detection_worker;
+
+detection_worker *detection_worker_create(void);
+
+/* Drops a queued job or waits for a running detection to finish. */
+void detection_worker_destroy(detection_worker *worker);
+
+/* True while a submitted job has not produced its result yet. busy, submit
+ * and poll never wait on a running detection; submit and poll must be
+ * called from the same thread. */
+bool detection_worker_busy(detection_worker *worker);
+
+/* Queues a job on the pool. Fails without taking the job if the worker is
+ * still busy, so callers never queue up stale frames, or if the pool is
+ * not running. */
+bool detection_worker_submit(detection_worker *worker, detection_job &&job);
+
+/* Drops a job that is still waiting in the queue, so the worker is idle
+ * again without producing a result. A detection that already started
+ * finishes and reports as usual. Call from the thread that submits. */
+void detection_worker_cancel(detection_worker *worker);
+
+/* Copies out the newest result if it is newer than *seq, updating *seq. */
+bool detection_worker_poll(detection_worker *worker, uint64_t *seq, detection_result *out);
@@ -0,0 +1,182 @@
+#include "fft_match.h"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+/* Spectra kept at once. A multi-scale, rotated bank ranks more variants than
+ * this per detection, but only the few that reach the full-frame levels are
+ * large enough for the FFT path to be picked; room is left for a few
+ * templates matched against the same frame. */
+static constexpr size_t FFT_CACHE_ENTRIES = 16;
+
+/* Relative cost of one DFT point versus one multiply-add of the direct
+ * correlation, including the inverse transform and the normalization pass. */
+static constexpr double FFT_COST_PER_POINT = 50.0;
+
+static cv::Size padded_dft_size(const cv::Size &frame_size)
+{
+	return cv::Size(cv::getOptimalDFTSize(frame_size.width),
+			cv::getOptimalDFTSize(frame_size.height));
+}
+
+bool fft_match_preferred(const cv::Size &frame_size, const cv::Size &templ_size)
+{
+	const double out_area = static_cast<double>(frame_size.width - templ_size.width + 1) *
+			static_cast<double>(frame_size.height - templ_size.height + 1);
+	if (out_area <= 0.0) {
+		return false;
+	}
+
+	const double spatial_cost = out_area * static_cast<double>(templ_size.area());
+	const double dft_points = static_cast<double>(padded_dft_size(frame_size).area());
+	const double fft_cost = FFT_COST_PER_POINT * dft_points * std::log2(dft_points);
+
+	return fft_cost < spatial_cost;
+}
+
+static bool same_key(const fft_template_key &a, const fft_template_key &b)
+{
+	return a.generation == b.generation && a.variant == b.variant && a.level == b.level;
+}
+
+/* Zero-mean template padded to the DFT size, transformed once. */
+static void compute_spectrum(const cv::Mat &templ_gray, const cv::Size &dft_size,
+		fft_spectrum *entry)
+{
+	cv::Mat templ;
+	templ_gray.convertTo(templ, CV_32F);
+
+	cv::Scalar mean;
+	cv::Scalar stddev;
+	cv::meanStdDev(templ, mean, stddev);
+	templ -= mean;
+
+	entry->templ_norm = stddev[0] * std::sqrt(static_cast<double>(templ.total()));
+
+	cv::Mat padded;
+	cv::copyMakeBorder(templ, padded, 0, dft_size.height - templ.rows, 0,
+			dft_size.width - templ.cols, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+	cv::dft(padded, entry->spectrum, 0, templ.rows);
+}
+
+static const fft_spectrum &find_spectrum(fft_match_cache *cache, const fft_template_key &key,
+		const cv::Mat &templ_gray, const cv::Size &dft_size)
+{
+	++cache->clock;
+
+	for (fft_spectrum &entry : cache->spectra) {
+		if (same_key(entry.key, key) && entry.dft_size == dft_size) {
+			entry.last_use = cache->clock;
+			return entry;
+		}
+	}
+
+	fft_spectrum *slot = nullptr;
+	if (cache->spectra.size() < FFT_CACHE_ENTRIES) {
+		cache->spectra.emplace_back();
+		slot = &cache->spectra.back();
+	} else {
+		slot = &*std::min_element(cache->spectra.begin(), cache->spectra.end(),
+				[](const fft_spectrum &a, const fft_spectrum &b) {
+					return a.last_use < b.last_use;
+				});
+	}
+
+	slot->key = key;
+	slot->dft_size = dft_size;
+	slot->last_use = cache->clock;
+	compute_spectrum(templ_gray, dft_size, slot);
+	return *slot;
+}
+
+void fft_match_reset_frames(fft_match_cache *cache)
+{
+	cache->frame_count = 0;
+}
+
+/* Zero-padded spectrum and integral images of a frame, computed once per
+ * frame and pyramid level. The DFT is at least as large as the frame, so no
+ * valid offset wraps around and no extra border is needed. */
+static const fft_frame &find_frame(fft_match_cache *cache, const cv::Mat &frame_gray)
+{
+	for (size_t i = 0; i < cache->frame_count; ++i) {
+		const fft_frame &entry = cache->frames[i];
+		if (entry.data == frame_gray.data && entry.size == frame_gray.size()) {
+			return entry;
+		}
+	}
+
+	if (cache->frames.size() == cache->frame_count) {
+		cache->frames.emplace_back();
+	}
+	fft_frame &entry = cache->frames[cache->frame_count++];
+	entry.data = frame_gray.data;
+	entry.size = frame_gray.size();
+	entry.dft_size = padded_dft_size(frame_gray.size());
+
+	const cv::Size &dft_size = entry.dft_size;
+	entry.padded.create(dft_size, CV_32F);
+	cv::Mat frame_area = entry.padded(cv::Rect(0, 0, frame_gray.cols, frame_gray.rows));
+	frame_gray.convertTo(frame_area, CV_32F);
+	if (dft_size.width > frame_gray.cols) {
+		entry.padded(cv::Rect(frame_gray.cols, 0, dft_size.width - frame_gray.cols,
+				frame_gray.rows)).setTo(cv::Scalar::all(0));
+	}
+	if (dft_size.height > frame_gray.rows) {
+		entry.padded(cv::Rect(0, frame_gray.rows, dft_size.width,
+				dft_size.height - frame_gray.rows)).setTo(cv::Scalar::all(0));
+	}
+
+	cv::dft(entry.padded, entry.spectrum, 0, frame_gray.rows);
+	cv::integral(frame_gray, entry.sum, entry.sqsum, CV_64F, CV_64F);
+	return entry;
+}
+
+void fft_match_template(fft_match_cache *cache, const fft_template_key &key,
+		const cv::Mat &frame_gray, const cv::Mat &templ_gray, cv::Mat &result)
+{
+	const fft_frame &frame = find_frame(cache, frame_gray);
+	const cv::Size result_size(frame_gray.cols - templ_gray.cols + 1,
+			frame_gray.rows - templ_gray.rows + 1);
+	const fft_spectrum &templ = find_spectrum(cache, key, templ_gray, frame.dft_size);
+
+	cv::mulSpectrums(frame.spectrum, templ.spectrum, cache->product, 0, true);
+	cv::dft(cache->product, cache->correlation,
+			cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT, result_size.height);
+
+	result.create(result_size, CV_32F);
+
+	/* The template is zero-mean, so the correlation already equals the
+	 * numerator of TM_CCOEFF_NORMED; only the window energy is left. */
+	const double inv_area = 1.0 / static_cast<double>(templ_gray.total());
+	const int w = templ_gray.cols;
+	const int h = templ_gray.rows;
+
+	for (int y = 0; y < result_size.height; ++y) {
+		const float *corr = cache->correlation.ptr<float>(y);
+		const double *s0 = frame.sum.ptr<double>(y);
+		const double *s1 = frame.sum.ptr<double>(y + h);
+		const double *q0 = frame.sqsum.ptr<double>(y);
+		const double *q1 = frame.sqsum.ptr<double>(y + h);
+		float *out = result.ptr<float>(y);
+
+		for (int x = 0; x < result_size.width; ++x) {
+			const double wnd_sum = s1[x + w] - s1[x] - s0[x + w] + s0[x];
+			const double wnd_sqsum = q1[x + w] - q1[x] - q0[x + w] + q0[x];
+			const double wnd_var = std::max(wnd_sqsum - wnd_sum * wnd_sum * inv_area, 0.0);
+			const double denom = std::sqrt(wnd_var) * templ.templ_norm;
+
+			if (templ.templ_norm < DBL_EPSILON) {
+				out[x] = 1.0f;
+			} else if (denom > DBL_EPSILON) {
+				out[x] = static_cast<float>(
+						std::clamp(static_cast<double>(corr[x]) / denom, -1.0, 1.0));
+			} else {
+				out[x] = 0.0f;
+			}
+		}
+	}
+}
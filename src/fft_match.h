@@ -0,0 +1,68 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Identifies one template image across detections. Every bank build gets a
+ * new generation, so a spectrum is never reused after the templates change
+ * even if the allocator hands out the same addresses again. */
+struct fft_template_key {
+	uint64_t generation;
+	size_t variant;
+	size_t level;
+};
+
+struct fft_spectrum {
+	fft_template_key key;
+	cv::Size dft_size;
+	cv::Mat spectrum;
+	double templ_norm;
+	uint64_t last_use;
+};
+
+/* Frame-side half of the correlation: the spectrum of the zero-padded
+ * frame and its integral images, which every template matched against the
+ * same frame shares. Keyed by the frame's pixel buffer and size. */
+struct fft_frame {
+	const uint8_t *data;
+	cv::Size size;
+	cv::Size dft_size;
+	cv::Mat padded;
+	cv::Mat spectrum;
+	cv::Mat sum;
+	cv::Mat sqsum;
+};
+
+/* Template spectra, frame data and DFT scratch kept between detections.
+ * Spectra are keyed by template and padded DFT size, so they are recomputed
+ * only when the templates or the frame resolution change. frames[0 ..
+ * frame_count) are valid for the current frame; entries past that keep
+ * their buffers for the next one. Single-threaded. */
+struct fft_match_cache {
+	std::vector<fft_spectrum> spectra;
+	uint64_t clock = 0;
+
+	std::vector<fft_frame> frames;
+	size_t frame_count = 0;
+
+	cv::Mat product;
+	cv::Mat correlation;
+};
+
+/* Rough cost model: true when the frequency-domain path is expected to beat
+ * cv::matchTemplate for this frame and template size. */
+bool fft_match_preferred(const cv::Size &frame_size, const cv::Size &templ_size);
+
+/* Forgets the frame-side data. Must be called before matching a frame
+ * whose pixels may differ from the previous one at the same address. */
+void fft_match_reset_frames(fft_match_cache *cache);
+
+/* TM_CCOEFF_NORMED computed as one cross-correlation in the frequency domain
+ * plus integral-image window statistics. result has the same size and
+ * meaning as the cv::matchTemplate output. The frame's spectrum and sums
+ * are computed on its first use since the last reset. */
+void fft_match_template(fft_match_cache *cache, const fft_template_key &key,
+		const cv::Mat &frame_gray, const cv::Mat &templ_gray, cv::Mat &result);
@@ -0,0 +1,266 @@
+#include "frame_luma.h"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SHAPE_OVERLAY_LUMA_SSE2 1
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define SHAPE_OVERLAY_LUMA_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Every other byte of src, starting at src[0]. Only the 2 * count - 1
+ * bytes that hold them are read. */
+static void gather_even_bytes(const uint8_t *src, uint8_t *dst, int count)
+{
+	/* The vector loops read 32 bytes for 16 samples, one past the last. */
+	const int vector_count = count - 1;
+	int i = 0;
+#if defined(SHAPE_OVERLAY_LUMA_SSE2)
+	const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+	for (; i + 16 <= vector_count; i += 16) {
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2 + 16));
+		const __m128i packed = _mm_packus_epi16(_mm_and_si128(a, low_bytes), _mm_and_si128(b, low_bytes));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), packed);
+	}
+#elif defined(SHAPE_OVERLAY_LUMA_NEON)
+	for (; i + 16 <= vector_count; i += 16) {
+		const uint8x16x2_t pairs = vld2q_u8(src + i * 2);
+		vst1q_u8(dst + i, pairs.val[0]);
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = src[i * 2];
+	}
+}
+
+static void narrow_samples(const uint16_t *src, uint8_t *dst, int count, int shift)
+{
+	int i = 0;
+#if defined(SHAPE_OVERLAY_LUMA_SSE2)
+	const __m128i count_reg = _mm_cvtsi32_si128(shift);
+	for (; i + 16 <= count; i += 16) {
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 8));
+		const __m128i packed = _mm_packus_epi16(_mm_srl_epi16(a, count_reg), _mm_srl_epi16(b, count_reg));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), packed);
+	}
+#elif defined(SHAPE_OVERLAY_LUMA_NEON)
+	const int16x8_t shift_reg = vdupq_n_s16(static_cast<int16_t>(-shift));
+	for (; i + 16 <= count; i += 16) {
+		const uint16x8_t a = vshlq_u16(vld1q_u16(src + i), shift_reg);
+		const uint16x8_t b = vshlq_u16(vld1q_u16(src + i + 8), shift_reg);
+		vst1q_u8(dst + i, vcombine_u8(vqmovn_u16(a), vqmovn_u16(b)));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = static_cast<uint8_t>(std::min(src[i] >> shift, 255));
+	}
+}
+
+
+/* cvtColor's fixed-point BGR -> gray weights, scaled by 1 << GRAY_SHIFT. */
+static constexpr int GRAY_WEIGHT_B = 1868;
+static constexpr int GRAY_WEIGHT_G = 9617;
+static constexpr int GRAY_WEIGHT_R = 4899;
+static constexpr int GRAY_SHIFT = 14;
+
+static int factor_shift(int factor)
+{
+	return factor >= 4 ? 2 : factor >= 2 ? 1 : 0;
+}
+
+#if defined(SHAPE_OVERLAY_LUMA_SSE2)
+/* (a0 + a1, a2 + a3, b0 + b1, b2 + b3) */
+static inline __m128i pair_sums(__m128i a, __m128i b)
+{
+	const __m128 fa = _mm_castsi128_ps(a);
+	const __m128 fb = _mm_castsi128_ps(b);
+	const __m128i even = _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0)));
+	const __m128i odd = _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1)));
+	return _mm_add_epi32(even, odd);
+}
+
+/* Fixed-point gray of four pixels as 32-bit lanes. */
+static inline __m128i gray4(const uint8_t *src, __m128i weights)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+	return pair_sums(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights),
+			_mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights));
+}
+#endif
+
+/* Adds the fixed-point gray of each group of `factor` pixels of one frame
+ * row to acc. */
+static void accumulate_gray_row(const uint8_t *src, bool rgba, int factor, int count, uint32_t *acc)
+{
+	const int weight0 = rgba ? GRAY_WEIGHT_R : GRAY_WEIGHT_B;
+	const int weight2 = rgba ? GRAY_WEIGHT_B : GRAY_WEIGHT_R;
+
+	int i = 0;
+#if defined(SHAPE_OVERLAY_LUMA_SSE2)
+	const __m128i weights = _mm_setr_epi16(static_cast<int16_t>(weight0), GRAY_WEIGHT_G,
+			static_cast<int16_t>(weight2), 0, static_cast<int16_t>(weight0), GRAY_WEIGHT_G,
+			static_cast<int16_t>(weight2), 0);
+	if (factor == 1) {
+		for (; i + 4 <= count; i += 4) {
+			__m128i *dst = reinterpret_cast<__m128i *>(acc + i);
+			_mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), gray4(src + i * 4, weights)));
+		}
+	} else if (factor == 2 || factor == 4) {
+		for (; i + 4 <= count; i += 4) {
+			const uint8_t *p = src + static_cast<size_t>(i) * static_cast<size_t>(factor) * 4u;
+			__m128i sums = pair_sums(gray4(p, weights), gray4(p + 16, weights));
+			if (factor == 4) {
+				sums = pair_sums(sums, pair_sums(gray4(p + 32, weights), gray4(p + 48, weights)));
+			}
+			__m128i *dst = reinterpret_cast<__m128i *>(acc + i);
+			_mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), sums));
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		const uint8_t *p = src + static_cast<size_t>(i) * static_cast<size_t>(factor) * 4u;
+		uint32_t sum = 0;
+		for (int k = 0; k < factor; ++k, p += 4) {
+			sum += static_cast<uint32_t>(p[0] * weight0 + p[1] * GRAY_WEIGHT_G + p[2] * weight2);
+		}
+		acc[i] += sum;
+	}
+}
+
+void extract_gray_bgra(const uint8_t *data, uint32_t linesize, bool rgba, int factor,
+		const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray)
+{
+	/* Full size too goes through the accumulator rather than cvtColor,
+	 * whose parallel_for_ allocates a job on every call. */
+	factor = std::max(factor, 1);
+	gray.create(region.height, region.width, CV_8UC1);
+
+	const int shift = GRAY_SHIFT + 2 * factor_shift(factor);
+	const uint32_t round = 1u << (shift - 1);
+	std::vector<uint32_t> &acc = scratch->acc32;
+	acc.resize(static_cast<size_t>(region.width));
+
+	for (int y = 0; y < region.height; ++y) {
+		std::fill(acc.begin(), acc.end(), 0u);
+		for (int k = 0; k < factor; ++k) {
+			const size_t frame_y = static_cast<size_t>((region.y + y) * factor + k);
+			const uint8_t *src = data + frame_y * linesize +
+					static_cast<size_t>(region.x) * static_cast<size_t>(factor) * 4u;
+			accumulate_gray_row(src, rgba, factor, region.width, acc.data());
+		}
+
+		uint8_t *dst = gray.ptr<uint8_t>(y);
+		for (int x = 0; x < region.width; ++x) {
+			dst[x] = static_cast<uint8_t>((acc[static_cast<size_t>(x)] + round) >> shift);
+		}
+	}
+}
+
+/* Box-averages factor x factor blocks of 8-bit luma rows. row(frame_y)
+ * returns the samples of a frame row starting at the region's first frame
+ * column. */
+template<typename RowFn>
+static void box_downscale(int factor, const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray,
+		RowFn row)
+{
+	gray.create(region.height, region.width, CV_8UC1);
+
+	const int shift = 2 * factor_shift(factor);
+	const int round = (1 << shift) >> 1;
+	std::vector<uint16_t> &acc = scratch->acc16;
+	acc.resize(static_cast<size_t>(region.width));
+
+	for (int y = 0; y < region.height; ++y) {
+		std::fill(acc.begin(), acc.end(), static_cast<uint16_t>(0));
+		for (int k = 0; k < factor; ++k) {
+			const uint8_t *src = row((region.y + y) * factor + k);
+			for (int x = 0; x < region.width; ++x, src += factor) {
+				int sum = 0;
+				for (int j = 0; j < factor; ++j) {
+					sum += src[j];
+				}
+				acc[static_cast<size_t>(x)] = static_cast<uint16_t>(acc[static_cast<size_t>(x)] + sum);
+			}
+		}
+
+		uint8_t *dst = gray.ptr<uint8_t>(y);
+		for (int x = 0; x < region.width; ++x) {
+			dst[x] = static_cast<uint8_t>((acc[static_cast<size_t>(x)] + round) >> shift);
+		}
+	}
+}
+
+void extract_luma8(const uint8_t *data, uint32_t linesize, int factor,
+		const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray)
+{
+	if (factor <= 1) {
+		const cv::Mat luma(region.y + region.height, region.x + region.width, CV_8UC1,
+				const_cast<uint8_t *>(data), linesize);
+		luma(region).copyTo(gray);
+		return;
+	}
+
+	box_downscale(factor, region, scratch, gray, [&](int frame_y) {
+		return data + static_cast<size_t>(frame_y) * linesize +
+				static_cast<size_t>(region.x) * static_cast<size_t>(factor);
+	});
+}
+
+void extract_packed_luma(const uint8_t *data, uint32_t linesize, int luma_offset, int factor,
+		const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray)
+{
+	const int frame_x = region.x * factor;
+	const int frame_w = region.width * factor;
+	const auto frame_row = [&](int frame_y) {
+		return data + static_cast<size_t>(frame_y) * linesize + static_cast<size_t>(frame_x) * 2u +
+				static_cast<size_t>(luma_offset);
+	};
+
+	if (factor <= 1) {
+		gray.create(region.height, region.width, CV_8UC1);
+		for (int y = 0; y < region.height; ++y) {
+			gather_even_bytes(frame_row(region.y + y), gray.ptr<uint8_t>(y), region.width);
+		}
+		return;
+	}
+
+	std::vector<uint8_t> &samples = scratch->samples;
+	samples.resize(static_cast<size_t>(frame_w));
+	box_downscale(factor, region, scratch, gray, [&](int frame_y) {
+		gather_even_bytes(frame_row(frame_y), samples.data(), frame_w);
+		return static_cast<const uint8_t *>(samples.data());
+	});
+}
+
+void extract_luma16(const uint8_t *data, uint32_t linesize, int shift, int factor,
+		const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray)
+{
+	const int frame_x = region.x * factor;
+	const int frame_w = region.width * factor;
+	const auto frame_row = [&](int frame_y) {
+		return reinterpret_cast<const uint16_t *>(data + static_cast<size_t>(frame_y) * linesize) +
+				frame_x;
+	};
+
+	if (factor <= 1) {
+		gray.create(region.height, region.width, CV_8UC1);
+		for (int y = 0; y < region.height; ++y) {
+			narrow_samples(frame_row(region.y + y), gray.ptr<uint8_t>(y), region.width, shift);
+		}
+		return;
+	}
+
+	std::vector<uint8_t> &samples = scratch->samples;
+	samples.resize(static_cast<size_t>(frame_w));
+	box_downscale(factor, region, scratch, gray, [&](int frame_y) {
+		narrow_samples(frame_row(frame_y), samples.data(), frame_w, shift);
+		return static_cast<const uint8_t *>(samples.data());
+	});
+}
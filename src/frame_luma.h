@@ -0,0 +1,40 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <vector>
+
+/* Grayscale images for detection, read straight from frame memory in one
+ * pass. They are `factor` times smaller than the frame (1, 2 or 4): pixel
+ * (x, y) of gray is the mean of the factor x factor block of frame pixels at
+ * ((region.x + x) * factor, (region.y + y) * factor). region is in those
+ * detection pixels and must lie within the frame divided by factor. */
+
+/* gray is created at the region size, which is a no-op when it already is
+ * that size, e.g. a view into a larger buffer kept by the caller. Row
+ * buffers for the downscaling passes come from `scratch` and keep their
+ * capacity between calls. */
+struct luma_scratch {
+	std::vector<uint32_t> acc32;
+	std::vector<uint16_t> acc16;
+	std::vector<uint8_t> samples;
+};
+
+/* BGRA/BGRX, or RGBA with rgba set, with cvtColor's gray weights. */
+void extract_gray_bgra(const uint8_t *data, uint32_t linesize, bool rgba, int factor,
+		const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray);
+
+/* An 8-bit luma plane. */
+void extract_luma8(const uint8_t *data, uint32_t linesize, int factor,
+		const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray);
+
+/* Packed 4:2:2 (YUY2, YVYU or UYVY). luma_offset is the byte offset of the
+ * first Y in a macropixel: 0 for YUY2/YVYU, 1 for UYVY. */
+void extract_packed_luma(const uint8_t *data, uint32_t linesize, int luma_offset, int factor,
+		const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray);
+
+/* A 16-bit luma plane, each sample shifted right by `shift`: 8 for P010,
+ * whose 10 bits sit in the high bits, and 2 for I010. */
+void extract_luma16(const uint8_t *data, uint32_t linesize, int shift, int factor,
+		const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray);
@@ -0,0 +1,241 @@
+#include "logo_index.h"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+/* Side of the square thumbnail a descriptor is made from. Small enough to
+ * compare a few hundred entries in microseconds, large enough to tell
+ * station logos of similar shape apart. */
+static constexpr int LOGO_DESCRIPTOR_SIDE = 16;
+
+/* Centroid images the localizer searches for. Each one is a full coarse
+ * search, so this bounds the cost of finding the logo-like spot. */
+static constexpr int LOGO_CLUSTERS = 8;
+
+/* Coarsest level the localizer may search at, and the smallest centroid
+ * side it accepts there, as for template pyramids. */
+static constexpr int LOGO_LOCATE_MAX_LEVEL = 3;
+static constexpr int LOGO_LOCATE_MIN_SIDE = 12;
+
+/* Least rotated variant, and of those the one closest to scale 1. */
+static size_t find_reference_variant(const template_bank &bank)
+{
+	size_t best = 0;
+	for (size_t i = 1; i < bank.size(); ++i) {
+		const template_variant &a = bank.variants[i];
+		const template_variant &b = bank.variants[best];
+		const float angle_a = std::fabs(a.angle);
+		const float angle_b = std::fabs(b.angle);
+		if (angle_a < angle_b ||
+				(angle_a == angle_b && std::fabs(a.scale - 1.0f) < std::fabs(b.scale - 1.0f))) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* Writes gray, resized to `size`, as a zero mean, unit length vector into
+ * row, a 1 x size.area() CV_32F view. A flat patch gives all zeros. */
+static void describe(const cv::Mat &gray, const cv::Size &size, cv::Mat &scratch, cv::Mat row)
+{
+	const bool shrink = gray.cols > size.width || gray.rows > size.height;
+	cv::resize(gray, scratch, size, 0.0, 0.0, shrink ? cv::INTER_AREA : cv::INTER_LINEAR);
+	scratch.reshape(1, 1).convertTo(row, CV_32F);
+
+	row -= cv::mean(row)[0];
+	const double norm = cv::norm(row);
+	if (norm > 0.0) {
+		row *= 1.0 / norm;
+	}
+}
+
+/* Rectangle of `size` centred on centre, moved inside the frame. Empty if
+ * it does not fit. */
+static cv::Rect centred_rect(const cv::Point2f &centre, const cv::Size &size,
+		const cv::Size &frame_size)
+{
+	if (size.width > frame_size.width || size.height > frame_size.height) {
+		return cv::Rect();
+	}
+
+	const int x = static_cast<int>(std::lround(centre.x - size.width * 0.5f));
+	const int y = static_cast<int>(std::lround(centre.y - size.height * 0.5f));
+	return cv::Rect(std::clamp(x, 0, frame_size.width - size.width),
+			std::clamp(y, 0, frame_size.height - size.height), size.width, size.height);
+}
+
+static int median(std::vector<int> values)
+{
+	std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+	return values[values.size() / 2];
+}
+
+/* Clusters the reference templates, scaled to their median size at the
+ * localizer level, into at most LOGO_CLUSTERS centroid images. */
+static void build_centroids(const std::vector<const cv::Mat *> &templates, logo_index &out)
+{
+	std::vector<int> widths;
+	std::vector<int> heights;
+	for (const cv::Mat *templ : templates) {
+		widths.push_back(templ->cols);
+		heights.push_back(templ->rows);
+	}
+	const cv::Size common(median(widths), median(heights));
+
+	int level = 0;
+	while (level < LOGO_LOCATE_MAX_LEVEL &&
+			std::min(common.width, common.height) >> (level + 1) >= LOGO_LOCATE_MIN_SIDE) {
+		++level;
+	}
+	const cv::Size size(std::max(common.width >> level, 1), std::max(common.height >> level, 1));
+	out.locate_level = level;
+
+	cv::Mat samples(static_cast<int>(templates.size()), size.area(), CV_32F);
+	cv::Mat scratch;
+	for (size_t i = 0; i < templates.size(); ++i) {
+		describe(*templates[i], size, scratch, samples.row(static_cast<int>(i)));
+	}
+
+	cv::Mat centers = samples;
+	if (templates.size() > static_cast<size_t>(LOGO_CLUSTERS)) {
+		cv::Mat labels;
+		cv::kmeans(samples, LOGO_CLUSTERS, labels,
+				cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 20, 1e-3),
+				3, cv::KMEANS_PP_CENTERS, centers);
+	}
+
+	for (int i = 0; i < centers.rows; ++i) {
+		out.centroids.push_back(centers.row(i).reshape(1, size.height).clone());
+	}
+}
+
+void build_logo_index(std::vector<std::shared_ptr<const template_bank>> banks, logo_index &out)
+{
+	static std::atomic<uint64_t> next_generation{1};
+
+	out.banks = std::move(banks);
+	out.reference_variant.assign(out.banks.size(), 0);
+	out.sizes.clear();
+	out.size_index.assign(out.banks.size(), 0);
+	out.centroids.clear();
+	out.locate_level = 0;
+	out.generation = next_generation++;
+
+	const int side = LOGO_DESCRIPTOR_SIDE;
+	out.descriptors = cv::Mat::zeros(static_cast<int>(out.banks.size()), side * side, CV_32F);
+
+	std::vector<const cv::Mat *> templates;
+	cv::Mat scratch;
+	for (size_t i = 0; i < out.banks.size(); ++i) {
+		const template_bank &bank = *out.banks[i];
+		if (bank.empty()) {
+			continue;
+		}
+
+		const size_t reference = find_reference_variant(bank);
+		const cv::Mat &templ = bank.variants[reference].pyramid[0];
+		out.reference_variant[i] = reference;
+		templates.push_back(&templ);
+
+		auto size = std::find(out.sizes.begin(), out.sizes.end(), templ.size());
+		if (size == out.sizes.end()) {
+			size = out.sizes.insert(size, templ.size());
+		}
+		out.size_index[i] = static_cast<size_t>(size - out.sizes.begin());
+
+		describe(templ, cv::Size(side, side), scratch, out.descriptors.row(static_cast<int>(i)));
+	}
+
+	if (!templates.empty()) {
+		build_centroids(templates, out);
+	}
+}
+
+size_t logo_index_levels(const logo_index &index)
+{
+	return static_cast<size_t>(index.locate_level) + 1;
+}
+
+size_t identify_logo(const match_workspace &ws, logo_workspace *lw, const logo_index &index,
+		logo_candidate *out, size_t max_count)
+{
+	const std::vector<cv::Mat> &pyramid = ws.frame_pyramid;
+	const size_t level = static_cast<size_t>(index.locate_level);
+	if (index.centroids.empty() || pyramid.size() <= level || max_count == 0) {
+		return 0;
+	}
+
+	/* Stage 1: the spot that looks most like any cluster of logos. */
+	pyramid[level].convertTo(lw->level, CV_32F);
+
+	double best_score = -std::numeric_limits<double>::infinity();
+	cv::Point2f centre;
+	for (const cv::Mat &centroid : index.centroids) {
+		if (centroid.cols > lw->level.cols || centroid.rows > lw->level.rows) {
+			continue;
+		}
+
+		cv::matchTemplate(lw->level, centroid, lw->result, cv::TM_CCOEFF_NORMED);
+		double score = 0.0;
+		cv::Point loc;
+		cv::minMaxLoc(lw->result, nullptr, &score, nullptr, &loc);
+		if (score > best_score) {
+			best_score = score;
+			const float unit = static_cast<float>(1 << level);
+			centre = cv::Point2f((loc.x + centroid.cols * 0.5f) * unit,
+					(loc.y + centroid.rows * 0.5f) * unit);
+		}
+	}
+
+	if (best_score == -std::numeric_limits<double>::infinity()) {
+		return 0;
+	}
+
+	/* Stage 2: describe the patch there once per template size and rank
+	 * every entry against it. */
+	const cv::Mat &frame = pyramid[0];
+	const int side = LOGO_DESCRIPTOR_SIDE;
+	lw->patch_descriptors.create(static_cast<int>(index.sizes.size()), side * side, CV_32F);
+	for (size_t i = 0; i < index.sizes.size(); ++i) {
+		const cv::Rect rect = centred_rect(centre, index.sizes[i], frame.size());
+		cv::Mat row = lw->patch_descriptors.row(static_cast<int>(i));
+		if (rect.empty()) {
+			row.setTo(0.0f);
+		} else {
+			describe(frame(rect), cv::Size(side, side), lw->patch, row);
+		}
+	}
+
+	lw->ranked.clear();
+	for (size_t i = 0; i < index.size(); ++i) {
+		if (index.banks[i]->empty()) {
+			continue;
+		}
+
+		const size_t size = index.size_index[i];
+		const cv::Rect rect = centred_rect(centre, index.sizes[size], frame.size());
+		if (rect.empty()) {
+			continue;
+		}
+
+		/* Leave room for the neighbouring scales and angles the
+		 * verification also tries. */
+		const int margin = std::max(rect.width, rect.height) / 2;
+		const float similarity = static_cast<float>(lw->patch_descriptors.row(
+				static_cast<int>(size)).dot(index.descriptors.row(static_cast<int>(i))));
+		lw->ranked.push_back({i, similarity,
+				tracking_window(rect.x, rect.y, rect.size(), margin, frame.size())});
+	}
+
+	const size_t count = std::min(max_count, lw->ranked.size());
+	std::partial_sort(lw->ranked.begin(), lw->ranked.begin() + count, lw->ranked.end(),
+			[](const logo_candidate &a, const logo_candidate &b) {
+				return a.similarity > b.similarity;
+			});
+	std::copy(lw->ranked.begin(), lw->ranked.begin() + count, out);
+	return count;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "template_match.h"
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* Identifies which of many logos is in a frame without searching for each
+ * of them. A localizer first finds the most logo-like spot: the templates
+ * are clustered into a few centroid images, which are searched at a coarse
+ * pyramid level. The patch there is then compared with a small descriptor
+ * of every template, and only the closest entries go on to a full
+ * resolution search. Sizes and positions are in detection pixels. */
+struct logo_index {
+	std::vector<std::shared_ptr<const template_bank>> banks;
+	/* Per entry: the variant closest to scale 1 and no rotation, which the
+	 * descriptor is made from and verification starts at. */
+	std::vector<size_t> reference_variant;
+
+	/* One row per entry: its reference template shrunk to a small square,
+	 * zero mean and unit length, so a dot product is a normalized
+	 * correlation. */
+	cv::Mat descriptors;
+	/* Distinct reference sizes, and the one of each entry. The frame patch
+	 * is described once per size. */
+	std::vector<cv::Size> sizes;
+	std::vector<size_t> size_index;
+
+	/* Localizer: cluster centroids of all templates at one common size,
+	 * searched at pyramid level locate_level. */
+	std::vector<cv::Mat> centroids;
+	int locate_level = 0;
+
+	/* Unique per build, like template_bank::generation. */
+	uint64_t generation = 0;
+
+	bool empty() const { return banks.empty(); }
+	size_t size() const { return banks.size(); }
+};
+
+/* Builds the index over the given banks, which keep their order. Banks
+ * without variants are kept as entries that never match. */
+void build_logo_index(std::vector<std::shared_ptr<const template_bank>> banks, logo_index &out);
+
+/* Pyramid levels a frame needs for locating logos of this index. */
+size_t logo_index_levels(const logo_index &index);
+
+/* An entry worth verifying: how closely it resembles the located patch,
+ * and the frame window to search for it. */
+struct logo_candidate {
+	size_t entry;
+	float similarity;
+	cv::Rect window;
+};
+
+/* Identification scratch kept between detections, like match_workspace. */
+struct logo_workspace {
+	cv::Mat level;
+	cv::Mat result;
+	cv::Mat patch;
+	cv::Mat patch_descriptors;
+	std::vector<logo_candidate> ranked;
+};
+
+/* Locates the most logo-like spot in the frame prepared by
+ * match_begin_frame and ranks the index entries there. Fills out with up
+ * to max_count candidates, most similar first, and returns how many. */
+size_t identify_logo(const match_workspace &ws, logo_workspace *lw, const logo_index &index,
+		logo_candidate *out, size_t max_count);
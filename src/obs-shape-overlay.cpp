@@ -1,15 +1,43 @@
 #include <obs-module.h>
+#include <util/config-file.h>
+#include "detection_worker.h"
 #include "shape_overlay_filter.h"
 
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE("obs-shape-overlay", "en-US")
 
+/* The detection budget shared by every filter, from the [Scheduler]
+ * section of scheduler.ini in the plugin's config directory. Missing
+ * files and keys keep the defaults. */
+static detection_scheduler_config load_scheduler_config(void)
+{
+	detection_scheduler_config config;
+
+	char *path = obs_module_config_path("scheduler.ini");
+	config_t *file = nullptr;
+	if (path && config_open(&file, path, CONFIG_OPEN_EXISTING) == CONFIG_SUCCESS) {
+		config_set_default_int(file, "Scheduler", "BudgetMsPerSec", config.budget_ms_per_sec);
+		config_set_default_int(file, "Scheduler", "BudgetBurstMs", config.budget_burst_ms);
+		config.budget_ms_per_sec = config_get_int(file, "Scheduler", "BudgetMsPerSec");
+		config.budget_burst_ms = config_get_int(file, "Scheduler", "BudgetBurstMs");
+		config_close(file);
+	}
+	bfree(path);
+	return config;
+}
+
 bool obs_module_load(void)
 {
+	detection_scheduler_start(load_scheduler_config());
 	obs_register_source(&shape_overlay_filter);
 	return true;
 }
 
+void obs_module_unload(void)
+{
+	detection_scheduler_stop();
+}
+
 const char *obs_module_description(void)
 {
 	return "Template match shape overlay filter";
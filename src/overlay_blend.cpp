@@ -0,0 +1,409 @@
+#include "overlay_blend.h"
+#include "overlay_blend_kernels.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(SHAPE_OVERLAY_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+#if defined(SHAPE_OVERLAY_HAVE_NEON)
+#include <arm_neon.h>
+#endif
+
+void blend_row_scalar(uint8_t *dst, const uint16_t *premul, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		const uint16_t *src_px = premul + static_cast<size_t>(i) * 4u;
+		uint8_t *dst_px = dst + static_cast<size_t>(i) * 4u;
+
+		const int inv_alpha = 255 - src_px[3];
+		dst_px[0] = static_cast<uint8_t>((src_px[0] + dst_px[0] * inv_alpha + 127) / 255);
+		dst_px[1] = static_cast<uint8_t>((src_px[1] + dst_px[1] * inv_alpha + 127) / 255);
+		dst_px[2] = static_cast<uint8_t>((src_px[2] + dst_px[2] * inv_alpha + 127) / 255);
+		dst_px[3] = 255;
+	}
+}
+
+#if defined(SHAPE_OVERLAY_HAVE_SSE2)
+/* v / 255 for v in [0, 65152] as (v + 1 + (v >> 8)) >> 8, exact over that
+ * range and free of 16-bit overflow. */
+static inline __m128i div255_epu16(__m128i v)
+{
+	const __m128i one = _mm_set1_epi16(1);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(v, one), _mm_srli_epi16(v, 8)), 8);
+}
+
+/* Two premultiplied pixels over two 16-bit dst pixels. */
+static inline __m128i blend_epu16(__m128i premul, __m128i dst)
+{
+	const __m128i v255 = _mm_set1_epi16(255);
+	const __m128i v127 = _mm_set1_epi16(127);
+	__m128i a = _mm_shufflelo_epi16(premul, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	const __m128i inv = _mm_sub_epi16(v255, a);
+	const __m128i sum = _mm_add_epi16(_mm_add_epi16(premul, _mm_mullo_epi16(dst, inv)), v127);
+	return div255_epu16(sum);
+}
+
+void blend_row_sse2(uint8_t *dst, const uint16_t *premul, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha_channel = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint8_t *d = dst + static_cast<size_t>(i) * 4u;
+		const uint16_t *s = premul + static_cast<size_t>(i) * 4u;
+		const __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i *>(d));
+		const __m128i s_lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+		const __m128i s_hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 8));
+
+		const __m128i lo = blend_epu16(s_lo, _mm_unpacklo_epi8(t, zero));
+		const __m128i hi = blend_epu16(s_hi, _mm_unpackhi_epi8(t, zero));
+		const __m128i out = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_channel);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(d), out);
+	}
+
+	blend_row_scalar(dst + static_cast<size_t>(i) * 4u, premul + static_cast<size_t>(i) * 4u,
+			count - i);
+}
+#endif
+
+#if defined(SHAPE_OVERLAY_HAVE_NEON)
+static inline uint8x8_t blend_u8(uint16x8_t premul, uint8x8_t dst, uint16x8_t inv)
+{
+	uint16x8_t v = vmlaq_u16(premul, vmovl_u8(dst), inv);
+	v = vaddq_u16(v, vdupq_n_u16(127));
+	/* v / 255 for v in [0, 65152], see div255_epu16. */
+	v = vshrq_n_u16(vaddq_u16(vaddq_u16(v, vdupq_n_u16(1)), vshrq_n_u16(v, 8)), 8);
+	return vmovn_u16(v);
+}
+
+void blend_row_neon(uint8_t *dst, const uint16_t *premul, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		uint8_t *d = dst + static_cast<size_t>(i) * 4u;
+		const uint16x8x4_t s = vld4q_u16(premul + static_cast<size_t>(i) * 4u);
+		uint8x8x4_t t = vld4_u8(d);
+
+		const uint16x8_t inv = vsubq_u16(vdupq_n_u16(255), s.val[3]);
+
+		t.val[0] = blend_u8(s.val[0], t.val[0], inv);
+		t.val[1] = blend_u8(s.val[1], t.val[1], inv);
+		t.val[2] = blend_u8(s.val[2], t.val[2], inv);
+		t.val[3] = vdup_n_u8(255);
+		vst4_u8(d, t);
+	}
+
+	blend_row_scalar(dst + static_cast<size_t>(i) * 4u, premul + static_cast<size_t>(i) * 4u,
+			count - i);
+}
+#endif
+
+static blend_row_fn select_blend_row(void)
+{
+#if defined(SHAPE_OVERLAY_HAVE_AVX2)
+	if (cv::checkHardwareSupport(CV_CPU_AVX2)) {
+		return blend_row_avx2;
+	}
+#endif
+#if defined(SHAPE_OVERLAY_HAVE_SSE2)
+	return blend_row_sse2;
+#elif defined(SHAPE_OVERLAY_HAVE_NEON)
+	return blend_row_neon;
+#else
+	return blend_row_scalar;
+#endif
+}
+
+void blend_plane_row(uint8_t *dst, int dst_step, const uint16_t *premul, int count, int channels)
+{
+	for (int i = 0; i < count; ++i) {
+		const int inv_alpha = 255 - premul[channels];
+		for (int c = 0; c < channels; ++c) {
+			dst[c] = static_cast<uint8_t>((premul[c] + dst[c] * inv_alpha + 127) / 255);
+		}
+		dst += dst_step;
+		premul += channels + 1;
+	}
+}
+
+void blend_plane_row16(uint8_t *dst, int dst_step, const uint32_t *premul, int count, int channels)
+{
+	for (int i = 0; i < count; ++i) {
+		uint16_t *samples = reinterpret_cast<uint16_t *>(dst);
+		const uint32_t inv_alpha = 255u - premul[channels];
+		for (int c = 0; c < channels; ++c) {
+			samples[c] = static_cast<uint16_t>((premul[c] + samples[c] * inv_alpha + 127u) / 255u);
+		}
+		dst += dst_step;
+		premul += channels + 1;
+	}
+}
+
+void overlay_alpha(const cv::Mat &overlay_bgra, float opacity, cv::Mat &alpha)
+{
+	/* Same expression the per-pixel blend used, so prepared output matches
+	 * it exactly. */
+	uint8_t alpha_lut[256];
+	for (int a = 0; a < 256; ++a) {
+		const int scaled = static_cast<int>(static_cast<float>(a) * opacity + 0.5f);
+		alpha_lut[a] = static_cast<uint8_t>(std::clamp(scaled, 0, 255));
+	}
+
+	alpha.create(overlay_bgra.rows, overlay_bgra.cols, CV_8UC1);
+	for (int y = 0; y < overlay_bgra.rows; ++y) {
+		const uint8_t *src = overlay_bgra.ptr<uint8_t>(y);
+		uint8_t *dst = alpha.ptr<uint8_t>(y);
+		for (int x = 0; x < overlay_bgra.cols; ++x) {
+			dst[x] = alpha_lut[src[static_cast<size_t>(x) * 4u + 3u]];
+		}
+	}
+}
+
+/* Splits each row of an alpha plane into opaque and partial spans, leaving
+ * out transparent pixels. push_partial(x, y, a) appends premul_stride
+ * values for one partial pixel. */
+template<typename Premul, typename PushPartial>
+static void build_spans(const cv::Mat &alpha, size_t premul_stride, std::vector<Premul> &premul,
+		std::vector<overlay_span> &spans, std::vector<size_t> &row_spans,
+		PushPartial push_partial)
+{
+	row_spans.reserve(static_cast<size_t>(alpha.rows) + 1u);
+
+	for (int y = 0; y < alpha.rows; ++y) {
+		const uint8_t *row = alpha.ptr<uint8_t>(y);
+		row_spans.push_back(spans.size());
+
+		int x = 0;
+		while (x < alpha.cols) {
+			if (row[x] == 0) {
+				++x;
+				continue;
+			}
+
+			overlay_span span;
+			span.x = x;
+			span.opaque = row[x] == 255;
+			span.premul_offset = span.opaque ? 0 : premul.size() / premul_stride;
+
+			for (; x < alpha.cols; ++x) {
+				const uint8_t a = row[x];
+				if (a == 0 || (a == 255) != span.opaque) {
+					break;
+				}
+				if (!span.opaque) {
+					push_partial(x, y, a);
+				}
+			}
+
+			span.length = x - span.x;
+			spans.push_back(span);
+		}
+	}
+
+	row_spans.push_back(spans.size());
+}
+
+void prepare_overlay(const cv::Mat &overlay_bgra, float opacity, prepared_overlay *out)
+{
+	*out = prepared_overlay();
+	if (overlay_bgra.empty()) {
+		return;
+	}
+
+	cv::Mat alpha;
+	overlay_alpha(overlay_bgra, opacity, alpha);
+	out->bgra = overlay_bgra.clone();
+
+	/* Opaque pixels are copied verbatim, so they must carry the alpha the
+	 * blend would have written. */
+	for (int y = 0; y < alpha.rows; ++y) {
+		const uint8_t *a = alpha.ptr<uint8_t>(y);
+		uint8_t *px = out->bgra.ptr<uint8_t>(y);
+		for (int x = 0; x < alpha.cols; ++x) {
+			if (a[x] == 255) {
+				px[static_cast<size_t>(x) * 4u + 3u] = 255;
+			}
+		}
+	}
+
+	build_spans(alpha, 4u, out->premul, out->spans, out->row_spans,
+			[out](int x, int y, uint8_t a) {
+				const uint8_t *px = out->bgra.ptr<uint8_t>(y) + static_cast<size_t>(x) * 4u;
+				out->premul.push_back(static_cast<uint16_t>(px[0] * a));
+				out->premul.push_back(static_cast<uint16_t>(px[1] * a));
+				out->premul.push_back(static_cast<uint16_t>(px[2] * a));
+				out->premul.push_back(a);
+			});
+}
+
+void prepare_plane(const cv::Mat &values, const cv::Mat &alpha, prepared_plane *out)
+{
+	*out = prepared_plane();
+	if (values.empty()) {
+		return;
+	}
+
+	out->values = values;
+	const int channels = values.channels();
+	const size_t premul_stride = static_cast<size_t>(channels) + 1u;
+
+	if (values.depth() == CV_16U) {
+		build_spans(alpha, premul_stride, out->premul_wide, out->spans, out->row_spans,
+				[out, channels](int x, int y, uint8_t a) {
+					const uint16_t *px = out->values.ptr<uint16_t>(y) +
+							static_cast<size_t>(x) * static_cast<size_t>(channels);
+					for (int c = 0; c < channels; ++c) {
+						out->premul_wide.push_back(static_cast<uint32_t>(px[c]) * a);
+					}
+					out->premul_wide.push_back(a);
+				});
+		return;
+	}
+
+	build_spans(alpha, premul_stride, out->premul, out->spans, out->row_spans,
+			[out, channels](int x, int y, uint8_t a) {
+				const uint8_t *px = out->values.ptr<uint8_t>(y) +
+						static_cast<size_t>(x) * static_cast<size_t>(channels);
+				for (int c = 0; c < channels; ++c) {
+					out->premul.push_back(static_cast<uint16_t>(px[c] * a));
+				}
+				out->premul.push_back(a);
+			});
+}
+
+/* Draws row oy of an overlay into a destination row, the overlay's left
+ * edge at dst_x, limited to overlay columns [clip_x0, clip_x1). */
+template<typename Premul, typename BlendRun>
+static void blend_row_spans(uint8_t *dst_row, size_t dst_step, int dst_x, const uint8_t *src_row,
+		size_t pixel_size, const std::vector<Premul> &premul, size_t premul_stride,
+		const std::vector<overlay_span> &spans, const std::vector<size_t> &row_spans, size_t oy,
+		int clip_x0, int clip_x1, BlendRun &blend_run)
+{
+	const size_t first = row_spans[oy];
+	const size_t last = row_spans[oy + 1u];
+	for (size_t s = first; s < last; ++s) {
+		const overlay_span &span = spans[s];
+		const int x0 = std::max(span.x, clip_x0);
+		const int x1 = std::min(span.x + span.length, clip_x1);
+		if (x0 >= x1) {
+			continue;
+		}
+
+		uint8_t *d = dst_row + static_cast<size_t>(dst_x + x0) * dst_step;
+		const uint8_t *src = src_row + static_cast<size_t>(x0) * pixel_size;
+		if (span.opaque && dst_step == pixel_size) {
+			std::memcpy(d, src, static_cast<size_t>(x1 - x0) * pixel_size);
+		} else if (span.opaque) {
+			for (int x = x0; x < x1; ++x, d += dst_step, src += pixel_size) {
+				std::memcpy(d, src, pixel_size);
+			}
+		} else {
+			const size_t offset = span.premul_offset + static_cast<size_t>(x0 - span.x);
+			blend_run(d, premul.data() + offset * premul_stride, x1 - x0);
+		}
+	}
+}
+
+/* Walks the spans of an overlay of values.cols x values.rows pixels placed
+ * at each of `count` positions, clipped to the destination, whose pixels
+ * are dst_step bytes apart. Destination rows are visited once, top to
+ * bottom, drawing every copy that covers the row, so overlapping copies
+ * come out as if drawn one after another in order. Opaque runs are copied
+ * from values; partial runs go to blend_run(dst, premul, count). */
+template<typename Premul, typename BlendRun>
+static void blend_spans(uint8_t *dst, uint32_t dst_linesize, size_t dst_step, int dst_w, int dst_h,
+		const cv::Mat &values, const std::vector<Premul> &premul, size_t premul_stride,
+		const std::vector<overlay_span> &spans, const std::vector<size_t> &row_spans,
+		const cv::Point *positions, size_t count, BlendRun blend_run)
+{
+	if (values.empty() || count == 0) {
+		return;
+	}
+
+	int start_y = dst_h;
+	int end_y = 0;
+	for (size_t i = 0; i < count; ++i) {
+		start_y = std::min(start_y, std::max(0, positions[i].y));
+		end_y = std::max(end_y, std::min(dst_h, positions[i].y + values.rows));
+	}
+
+	const size_t pixel_size = values.elemSize();
+
+	for (int fy = start_y; fy < end_y; ++fy) {
+		uint8_t *dst_row = dst + (static_cast<size_t>(fy) * dst_linesize);
+
+		for (size_t i = 0; i < count; ++i) {
+			const int dst_x = positions[i].x;
+			const int oy = fy - positions[i].y;
+			if (oy < 0 || oy >= values.rows) {
+				continue;
+			}
+
+			/* Visible overlay columns. */
+			const int clip_x0 = std::max(0, -dst_x);
+			const int clip_x1 = std::min(values.cols, dst_w - dst_x);
+			if (clip_x0 >= clip_x1) {
+				continue;
+			}
+
+			blend_row_spans(dst_row, dst_step, dst_x, values.ptr<uint8_t>(oy), pixel_size,
+					premul, premul_stride, spans, row_spans, static_cast<size_t>(oy),
+					clip_x0, clip_x1, blend_run);
+		}
+	}
+}
+
+void blend_overlay_bgra(uint8_t *dst, uint32_t dst_linesize,
+		int frame_w, int frame_h, const prepared_overlay &overlay,
+		const cv::Point *positions, size_t count)
+{
+	static const blend_row_fn blend_row = select_blend_row();
+
+	blend_spans(dst, dst_linesize, 4u, frame_w, frame_h, overlay.bgra, overlay.premul, 4u,
+			overlay.spans, overlay.row_spans, positions, count, blend_row);
+}
+
+void blend_overlay_bgra(uint8_t *dst, uint32_t dst_linesize,
+		int frame_w, int frame_h, const prepared_overlay &overlay,
+		int dst_x, int dst_y)
+{
+	const cv::Point position(dst_x, dst_y);
+	blend_overlay_bgra(dst, dst_linesize, frame_w, frame_h, overlay, &position, 1);
+}
+
+void blend_overlay_plane(uint8_t *dst, uint32_t dst_linesize, int dst_step,
+		int plane_w, int plane_h, const prepared_plane &plane,
+		const cv::Point *positions, size_t count)
+{
+	const int channels = plane.values.channels();
+	const size_t premul_stride = static_cast<size_t>(channels) + 1u;
+
+	if (plane.values.depth() == CV_16U) {
+		blend_spans(dst, dst_linesize, static_cast<size_t>(dst_step), plane_w, plane_h,
+				plane.values, plane.premul_wide, premul_stride,
+				plane.spans, plane.row_spans, positions, count,
+				[channels, dst_step](uint8_t *d, const uint32_t *premul, int n) {
+					blend_plane_row16(d, dst_step, premul, n, channels);
+				});
+		return;
+	}
+
+	blend_spans(dst, dst_linesize, static_cast<size_t>(dst_step), plane_w, plane_h,
+			plane.values, plane.premul, premul_stride,
+			plane.spans, plane.row_spans, positions, count,
+			[channels, dst_step](uint8_t *d, const uint16_t *premul, int n) {
+				blend_plane_row(d, dst_step, premul, n, channels);
+			});
+}
+
+void blend_overlay_plane(uint8_t *dst, uint32_t dst_linesize, int dst_step,
+		int plane_w, int plane_h, const prepared_plane &plane,
+		int dst_x, int dst_y)
+{
+	const cv::Point position(dst_x, dst_y);
+	blend_overlay_plane(dst, dst_linesize, dst_step, plane_w, plane_h, plane, &position, 1);
+}
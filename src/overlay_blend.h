@@ -0,0 +1,84 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* A run of overlay pixels that need drawing. Fully transparent pixels are
+ * the gaps between spans and are never touched. */
+struct overlay_span {
+	int x;
+	int length;
+	bool opaque;
+	/* Partial spans only: first pixel in prepared_overlay::premul. */
+	size_t premul_offset;
+};
+
+/* Overlay prepared for blending with the opacity baked in. Opaque spans are
+ * copied straight from bgra; partial spans blend premultiplied colors. */
+struct prepared_overlay {
+	cv::Mat bgra;
+	/* B * a, G * a, R * a, a per partial pixel, a with opacity applied. */
+	std::vector<uint16_t> premul;
+	std::vector<overlay_span> spans;
+	/* Spans of row y are [row_spans[y], row_spans[y + 1]). */
+	std::vector<size_t> row_spans;
+
+	bool empty() const { return bgra.empty(); }
+	int width() const { return bgra.cols; }
+	int height() const { return bgra.rows; }
+};
+
+/* One plane of an overlay converted to a frame's pixel format: 8- or
+ * 16-bit values with one or two interleaved channels, split into spans like
+ * prepared_overlay. Partial pixels store each channel times a, then a, in
+ * premul for 8-bit values and in premul_wide for 16-bit ones. */
+struct prepared_plane {
+	cv::Mat values;
+	std::vector<uint16_t> premul;
+	std::vector<uint32_t> premul_wide;
+	std::vector<overlay_span> spans;
+	std::vector<size_t> row_spans;
+
+	bool empty() const { return values.empty(); }
+};
+
+/* Effective 8-bit alpha of a BGRA overlay with opacity applied. */
+void overlay_alpha(const cv::Mat &overlay_bgra, float opacity, cv::Mat &alpha);
+
+/* Splits every row of a BGRA overlay into transparent, opaque and partial
+ * runs after applying opacity, and premultiplies the partial pixels. */
+void prepare_overlay(const cv::Mat &overlay_bgra, float opacity, prepared_overlay *out);
+
+/* Splits a plane into spans by the matching effective alpha plane and
+ * premultiplies its partial pixels. */
+void prepare_plane(const cv::Mat &values, const cv::Mat &alpha, prepared_plane *out);
+
+/* Alpha-blends a prepared overlay into a BGRA/BGRX frame at (dst_x, dst_y),
+ * clipped to the frame. Transparent pixels are left untouched, opaque runs
+ * are copied, and partial pixels are blended and get an alpha of 255 with
+ * the widest SIMD kernel the CPU supports. The output is the same as blending
+ * the unprepared overlay pixel by pixel. */
+void blend_overlay_bgra(uint8_t *dst, uint32_t dst_linesize,
+		int frame_w, int frame_h, const prepared_overlay &overlay,
+		int dst_x, int dst_y);
+
+/* Blends copies of the overlay at each of `count` positions in one pass
+ * over the frame rows, with the same result as blending them one after
+ * another in order. */
+void blend_overlay_bgra(uint8_t *dst, uint32_t dst_linesize,
+		int frame_w, int frame_h, const prepared_overlay &overlay,
+		const cv::Point *positions, size_t count);
+
+/* Blends a prepared plane into a frame plane of plane_w x plane_h samples
+ * at (dst_x, dst_y), clipped to the plane. Samples are dst_step bytes apart,
+ * which is the channel count for planar data and larger for a component of
+ * a packed format. */
+void blend_overlay_plane(uint8_t *dst, uint32_t dst_linesize, int dst_step,
+		int plane_w, int plane_h, const prepared_plane &plane,
+		int dst_x, int dst_y);
+void blend_overlay_plane(uint8_t *dst, uint32_t dst_linesize, int dst_step,
+		int plane_w, int plane_h, const prepared_plane &plane,
+		const cv::Point *positions, size_t count);
@@ -0,0 +1,53 @@
+/* Built with AVX2 enabled; only called after a runtime CPU check. */
+
+#include "overlay_blend_kernels.h"
+
+#include <immintrin.h>
+
+/* v / 255 for v in [0, 65152], see div255_epu16 in overlay_blend.cpp. */
+static inline __m256i div255_epu16(__m256i v)
+{
+	const __m256i one = _mm256_set1_epi16(1);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(v, one), _mm256_srli_epi16(v, 8)), 8);
+}
+
+/* Four premultiplied pixels (two per lane) over four 16-bit dst pixels. */
+static inline __m256i blend_epu16(__m256i premul, __m256i dst)
+{
+	const __m256i v255 = _mm256_set1_epi16(255);
+	const __m256i v127 = _mm256_set1_epi16(127);
+	__m256i a = _mm256_shufflelo_epi16(premul, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	const __m256i inv = _mm256_sub_epi16(v255, a);
+	const __m256i sum = _mm256_add_epi16(_mm256_add_epi16(premul, _mm256_mullo_epi16(dst, inv)), v127);
+	return div255_epu16(sum);
+}
+
+void blend_row_avx2(uint8_t *dst, const uint16_t *premul, int count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha_channel = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		uint8_t *d = dst + static_cast<size_t>(i) * 4u;
+		const uint16_t *s = premul + static_cast<size_t>(i) * 4u;
+		const __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(d));
+		const __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+		const __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + 16));
+
+		/* The byte unpacks work per lane: lo holds pixels 0, 1, 4, 5 and
+		 * hi pixels 2, 3, 6, 7, so regroup the premultiplied pixels to
+		 * match. */
+		const __m256i s_lo = _mm256_permute2x128_si256(s0, s1, 0x20);
+		const __m256i s_hi = _mm256_permute2x128_si256(s0, s1, 0x31);
+
+		const __m256i lo = blend_epu16(s_lo, _mm256_unpacklo_epi8(t, zero));
+		const __m256i hi = blend_epu16(s_hi, _mm256_unpackhi_epi8(t, zero));
+		const __m256i out = _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_channel);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(d), out);
+	}
+
+	blend_row_scalar(dst + static_cast<size_t>(i) * 4u, premul + static_cast<size_t>(i) * 4u,
+			count - i);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+/* Row kernels behind blend_overlay_bgra. Each blends `count` premultiplied
+ * pixels (B * a, G * a, R * a, a as 16-bit values, 0 < a < 255) into BGRA
+ * dst:
+ *
+ *   dst.c = (premul.c + dst.c * (255 - a) + 127) / 255, dst.a = 255
+ *
+ * All kernels must produce identical bytes. */
+typedef void (*blend_row_fn)(uint8_t *dst, const uint16_t *premul, int count);
+
+void blend_row_scalar(uint8_t *dst, const uint16_t *premul, int count);
+
+/* Plane counterpart: premul holds `channels` values and then a per pixel,
+ * dst pixels are dst_step bytes apart and only their value channels are
+ * written. Used for the partial edges of YUV overlays, which are too short
+ * to benefit from SIMD. */
+void blend_plane_row(uint8_t *dst, int dst_step, const uint16_t *premul, int count, int channels);
+
+/* Same for 16-bit samples; dst_step is still in bytes. */
+void blend_plane_row16(uint8_t *dst, int dst_step, const uint32_t *premul, int count, int channels);
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SHAPE_OVERLAY_HAVE_SSE2 1
+void blend_row_sse2(uint8_t *dst, const uint16_t *premul, int count);
+#endif
+
+#if defined(SHAPE_OVERLAY_HAVE_AVX2)
+void blend_row_avx2(uint8_t *dst, const uint16_t *premul, int count);
+#endif
+
+#if defined(__ARM_NEON) || defined(_M_ARM64)
+#define SHAPE_OVERLAY_HAVE_NEON 1
+void blend_row_neon(uint8_t *dst, const uint16_t *premul, int count);
+#endif
@@ -0,0 +1,367 @@
+#include "overlay_yuv.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+bool same_colorimetry(const yuv_colorimetry &a, const yuv_colorimetry &b)
+{
+	return a.layout == b.layout && a.full_range == b.full_range &&
+			std::memcmp(a.color_matrix, b.color_matrix, sizeof(a.color_matrix)) == 0;
+}
+
+/* Inverts the 3x3 part of a row-major 4x4 matrix. */
+static bool invert_3x3(const float m[16], double inv[9])
+{
+	const double a = m[0], b = m[1], c = m[2];
+	const double d = m[4], e = m[5], f = m[6];
+	const double g = m[8], h = m[9], i = m[10];
+
+	const double det = a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+	if (std::fabs(det) < 1e-9) {
+		return false;
+	}
+
+	inv[0] = (e * i - f * h) / det;
+	inv[1] = (c * h - b * i) / det;
+	inv[2] = (b * f - c * e) / det;
+	inv[3] = (f * g - d * i) / det;
+	inv[4] = (a * i - c * g) / det;
+	inv[5] = (c * d - a * f) / det;
+	inv[6] = (d * h - e * g) / det;
+	inv[7] = (b * g - a * h) / det;
+	inv[8] = (a * e - b * d) / det;
+	return true;
+}
+
+/* Sample arrangement of a layout. Samples hold `bits` significant bits
+ * shifted left by `shift` in a sample_size-byte container. */
+struct layout_traits {
+	int sample_size;
+	int bits;
+	int shift;
+	/* Chroma subsampling factors. */
+	int sub_x;
+	int sub_y;
+	bool packed;
+	bool interleaved_chroma;
+};
+
+static layout_traits get_layout_traits(yuv_layout layout)
+{
+	switch (layout) {
+	case YUV_LAYOUT_NV12:
+		return {1, 8, 0, 2, 2, false, true};
+	case YUV_LAYOUT_I420:
+		return {1, 8, 0, 2, 2, false, false};
+	case YUV_LAYOUT_I444:
+		return {1, 8, 0, 1, 1, false, false};
+	case YUV_LAYOUT_YUY2:
+	case YUV_LAYOUT_YVYU:
+	case YUV_LAYOUT_UYVY:
+		return {1, 8, 0, 2, 1, true, false};
+	case YUV_LAYOUT_P010:
+		return {2, 10, 6, 2, 2, false, true};
+	case YUV_LAYOUT_I010:
+		return {2, 10, 0, 2, 2, false, false};
+	}
+	return {1, 8, 0, 1, 1, false, false};
+}
+
+/* A normalized value as a frame sample. */
+static int to_sample(double v, const layout_traits &traits)
+{
+	const long max_value = (1L << traits.bits) - 1;
+	return static_cast<int>(std::clamp(std::lround(v * max_value), 0L, max_value) << traits.shift);
+}
+
+template<typename T>
+static void convert_pixels(const cv::Mat &overlay_bgra, const float *m, const double inv[9],
+		const layout_traits &traits, cv::Mat &y, cv::Mat &u, cv::Mat &v)
+{
+	for (int row = 0; row < overlay_bgra.rows; ++row) {
+		const uint8_t *src = overlay_bgra.ptr<uint8_t>(row);
+		T *y_row = y.ptr<T>(row);
+		T *u_row = u.ptr<T>(row);
+		T *v_row = v.ptr<T>(row);
+
+		for (int x = 0; x < overlay_bgra.cols; ++x) {
+			const uint8_t *px = src + static_cast<size_t>(x) * 4u;
+			const double r = px[2] / 255.0 - m[3];
+			const double g = px[1] / 255.0 - m[7];
+			const double b = px[0] / 255.0 - m[11];
+
+			y_row[x] = static_cast<T>(to_sample(inv[0] * r + inv[1] * g + inv[2] * b, traits));
+			u_row[x] = static_cast<T>(to_sample(inv[3] * r + inv[4] * g + inv[5] * b, traits));
+			v_row[x] = static_cast<T>(to_sample(inv[6] * r + inv[7] * g + inv[8] * b, traits));
+		}
+	}
+}
+
+bool convert_overlay_yuv(const cv::Mat &overlay_bgra, float opacity,
+		const yuv_colorimetry &colorimetry, yuv_overlay *out)
+{
+	*out = yuv_overlay();
+	out->colorimetry = colorimetry;
+
+	/* The frame matrix maps (Y, U, V, 1) to RGB; undo its offset column
+	 * and 3x3 part to go back. */
+	const float *m = colorimetry.color_matrix;
+	double inv[9];
+	if (overlay_bgra.empty() || !invert_3x3(m, inv)) {
+		return false;
+	}
+
+	const layout_traits traits = get_layout_traits(colorimetry.layout);
+	const int type = traits.sample_size == 2 ? CV_16UC1 : CV_8UC1;
+
+	cv::Mat y(overlay_bgra.rows, overlay_bgra.cols, type);
+	out->u.create(overlay_bgra.rows, overlay_bgra.cols, type);
+	out->v.create(overlay_bgra.rows, overlay_bgra.cols, type);
+
+	if (traits.sample_size == 2) {
+		convert_pixels<uint16_t>(overlay_bgra, m, inv, traits, y, out->u, out->v);
+	} else {
+		convert_pixels<uint8_t>(overlay_bgra, m, inv, traits, y, out->u, out->v);
+	}
+
+	overlay_alpha(overlay_bgra, opacity, out->alpha);
+	prepare_plane(y, out->alpha, &out->luma);
+	return true;
+}
+
+/* Subsampled chroma planes for one phase. A chroma sample covers up to
+ * sub_x * sub_y overlay pixels: its value is their alpha-weighted mean and
+ * its alpha their coverage, so a sample half outside the overlay blends at
+ * half strength. */
+template<typename T>
+static void subsample_chroma(const yuv_overlay &overlay, const layout_traits &traits,
+		int phase_x, int phase_y, cv::Mat &alpha, cv::Mat &u, cv::Mat &v)
+{
+	const int cols = overlay.alpha.cols;
+	const int rows = overlay.alpha.rows;
+	const int chroma_w = (cols + phase_x + traits.sub_x - 1) / traits.sub_x;
+	const int chroma_h = (rows + phase_y + traits.sub_y - 1) / traits.sub_y;
+	const int type = traits.sample_size == 2 ? CV_16UC1 : CV_8UC1;
+	const int samples = traits.sub_x * traits.sub_y;
+
+	alpha.create(chroma_h, chroma_w, CV_8UC1);
+	u.create(chroma_h, chroma_w, type);
+	v.create(chroma_h, chroma_w, type);
+
+	for (int cy = 0; cy < chroma_h; ++cy) {
+		uint8_t *a_row = alpha.ptr<uint8_t>(cy);
+		T *u_row = u.ptr<T>(cy);
+		T *v_row = v.ptr<T>(cy);
+
+		for (int cx = 0; cx < chroma_w; ++cx) {
+			int64_t sum_a = 0;
+			int64_t sum_u = 0;
+			int64_t sum_v = 0;
+
+			for (int dy = 0; dy < traits.sub_y; ++dy) {
+				const int oy = cy * traits.sub_y - phase_y + dy;
+				if (oy < 0 || oy >= rows) {
+					continue;
+				}
+				for (int dx = 0; dx < traits.sub_x; ++dx) {
+					const int ox = cx * traits.sub_x - phase_x + dx;
+					if (ox < 0 || ox >= cols) {
+						continue;
+					}
+					const int a = overlay.alpha.ptr<uint8_t>(oy)[ox];
+					sum_a += a;
+					sum_u += a * overlay.u.ptr<T>(oy)[ox];
+					sum_v += a * overlay.v.ptr<T>(oy)[ox];
+				}
+			}
+
+			/* Transparent samples are never drawn, so their value
+			 * does not matter. */
+			a_row[cx] = static_cast<uint8_t>((sum_a + samples / 2) / samples);
+			u_row[cx] = static_cast<T>(sum_a ? (sum_u + sum_a / 2) / sum_a : 0);
+			v_row[cx] = static_cast<T>(sum_a ? (sum_v + sum_a / 2) / sum_a : 0);
+		}
+	}
+}
+
+template<typename T>
+static cv::Mat interleave_chroma(const cv::Mat &u, const cv::Mat &v)
+{
+	cv::Mat uv(u.rows, u.cols, sizeof(T) == 2 ? CV_16UC2 : CV_8UC2);
+	for (int cy = 0; cy < u.rows; ++cy) {
+		const T *u_row = u.ptr<T>(cy);
+		const T *v_row = v.ptr<T>(cy);
+		T *uv_row = uv.ptr<T>(cy);
+		for (int cx = 0; cx < u.cols; ++cx) {
+			uv_row[cx * 2] = u_row[cx];
+			uv_row[cx * 2 + 1] = v_row[cx];
+		}
+	}
+	return uv;
+}
+
+static void build_chroma(yuv_overlay *overlay, int phase)
+{
+	const layout_traits traits = get_layout_traits(overlay->colorimetry.layout);
+	prepared_plane *chroma = overlay->chroma[phase];
+
+	if (traits.sub_x == 1 && traits.sub_y == 1) {
+		prepare_plane(overlay->u, overlay->alpha, &chroma[0]);
+		prepare_plane(overlay->v, overlay->alpha, &chroma[1]);
+		overlay->chroma_ready[phase] = true;
+		return;
+	}
+
+	cv::Mat alpha;
+	cv::Mat u;
+	cv::Mat v;
+	const bool wide = traits.sample_size == 2;
+	if (wide) {
+		subsample_chroma<uint16_t>(*overlay, traits, phase & 1, phase >> 1, alpha, u, v);
+	} else {
+		subsample_chroma<uint8_t>(*overlay, traits, phase & 1, phase >> 1, alpha, u, v);
+	}
+
+	if (traits.interleaved_chroma) {
+		const cv::Mat uv = wide ? interleave_chroma<uint16_t>(u, v) : interleave_chroma<uint8_t>(u, v);
+		prepare_plane(uv, alpha, &chroma[0]);
+	} else {
+		prepare_plane(u, alpha, &chroma[0]);
+		prepare_plane(v, alpha, &chroma[1]);
+	}
+
+	overlay->chroma_ready[phase] = true;
+}
+
+/* Byte offsets of Y, U and V in a packed 4:2:2 macropixel. */
+static void packed_offsets(yuv_layout layout, int *y, int *u, int *v)
+{
+	switch (layout) {
+	case YUV_LAYOUT_UYVY:
+		*y = 1;
+		*u = 0;
+		*v = 2;
+		break;
+	case YUV_LAYOUT_YVYU:
+		*y = 0;
+		*u = 3;
+		*v = 1;
+		break;
+	default:
+		*y = 0;
+		*u = 1;
+		*v = 3;
+		break;
+	}
+}
+
+/* Chroma positions of one phase blended per pass. Copies of the overlay
+ * at draw positions of different parity use different chroma planes. */
+static constexpr size_t CHROMA_BATCH = 16;
+
+/* Calls blend(chroma, positions, count) for the draw positions of each
+ * chroma phase in turn, with positions in chroma samples. sub_y is 2 for
+ * vertically subsampled chroma and 1 otherwise; chroma is always
+ * subsampled horizontally here. Two's complement keeps & 1 the parity for
+ * negative positions too, and position - phase is even, so the division
+ * is exact. */
+template<typename Blend>
+static void for_each_chroma_phase(yuv_overlay &overlay, const cv::Point *positions, size_t count,
+		int sub_y, Blend blend)
+{
+	for (int phase = 0; phase < 4; ++phase) {
+		cv::Point batch[CHROMA_BATCH];
+		size_t batched = 0;
+
+		for (size_t i = 0; i < count; ++i) {
+			const int phase_x = positions[i].x & 1;
+			const int phase_y = sub_y == 2 ? positions[i].y & 1 : 0;
+			if ((phase_x | (phase_y << 1)) != phase) {
+				continue;
+			}
+
+			if (!overlay.chroma_ready[phase]) {
+				build_chroma(&overlay, phase);
+			}
+			batch[batched++] = cv::Point((positions[i].x - phase_x) / 2,
+					(positions[i].y - phase_y) / sub_y);
+			if (batched == CHROMA_BATCH) {
+				blend(overlay.chroma[phase], batch, batched);
+				batched = 0;
+			}
+		}
+
+		if (batched > 0) {
+			blend(overlay.chroma[phase], batch, batched);
+		}
+	}
+}
+
+void blend_overlay_yuv(uint8_t *const planes[], const uint32_t linesize[],
+		int frame_w, int frame_h, yuv_overlay &overlay, const cv::Point *positions, size_t count)
+{
+	if (overlay.luma.empty() || count == 0) {
+		return;
+	}
+
+	const yuv_layout layout = overlay.colorimetry.layout;
+	const layout_traits traits = get_layout_traits(layout);
+	const int sample = traits.sample_size;
+
+	if (traits.packed) {
+		int y_offset = 0;
+		int u_offset = 0;
+		int v_offset = 0;
+		packed_offsets(layout, &y_offset, &u_offset, &v_offset);
+
+		/* Packed chroma is only subsampled horizontally. */
+		const int chroma_w = (frame_w + 1) / 2;
+		blend_overlay_plane(planes[0] + y_offset, linesize[0], 2, frame_w, frame_h,
+				overlay.luma, positions, count);
+		for_each_chroma_phase(overlay, positions, count, 1,
+				[&](const prepared_plane *chroma, const cv::Point *chroma_pos, size_t n) {
+					blend_overlay_plane(planes[0] + u_offset, linesize[0], 4, chroma_w,
+							frame_h, chroma[0], chroma_pos, n);
+					blend_overlay_plane(planes[0] + v_offset, linesize[0], 4, chroma_w,
+							frame_h, chroma[1], chroma_pos, n);
+				});
+		return;
+	}
+
+	blend_overlay_plane(planes[0], linesize[0], sample, frame_w, frame_h,
+			overlay.luma, positions, count);
+
+	if (traits.sub_x == 1 && traits.sub_y == 1) {
+		if (!overlay.chroma_ready[0]) {
+			build_chroma(&overlay, 0);
+		}
+		blend_overlay_plane(planes[1], linesize[1], sample, frame_w, frame_h,
+				overlay.chroma[0][0], positions, count);
+		blend_overlay_plane(planes[2], linesize[2], sample, frame_w, frame_h,
+				overlay.chroma[0][1], positions, count);
+		return;
+	}
+
+	const int chroma_w = (frame_w + 1) / 2;
+	const int chroma_h = (frame_h + 1) / 2;
+	for_each_chroma_phase(overlay, positions, count, 2,
+			[&](const prepared_plane *chroma, const cv::Point *chroma_pos, size_t n) {
+				if (traits.interleaved_chroma) {
+					blend_overlay_plane(planes[1], linesize[1], 2 * sample, chroma_w,
+							chroma_h, chroma[0], chroma_pos, n);
+				} else {
+					blend_overlay_plane(planes[1], linesize[1], sample, chroma_w,
+							chroma_h, chroma[0], chroma_pos, n);
+					blend_overlay_plane(planes[2], linesize[2], sample, chroma_w,
+							chroma_h, chroma[1], chroma_pos, n);
+				}
+			});
+}
+
+void blend_overlay_yuv(uint8_t *const planes[], const uint32_t linesize[],
+		int frame_w, int frame_h, yuv_overlay &overlay, int dst_x, int dst_y)
+{
+	const cv::Point position(dst_x, dst_y);
+	blend_overlay_yuv(planes, linesize, frame_w, frame_h, overlay, &position, 1);
+}
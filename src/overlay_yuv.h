@@ -0,0 +1,73 @@
+#pragma once
+
+#include "overlay_blend.h"
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+
+/* YUV layouts the overlay can be drawn into. */
+enum yuv_layout {
+	/* Y plane, interleaved UV plane at half width and height. */
+	YUV_LAYOUT_NV12,
+	/* Y, U and V planes, chroma at half width and height. */
+	YUV_LAYOUT_I420,
+	/* Y, U and V planes at full resolution. */
+	YUV_LAYOUT_I444,
+	/* Packed 4:2:2, one plane of Y0 U Y1 V. */
+	YUV_LAYOUT_YUY2,
+	/* Packed 4:2:2, one plane of Y0 V Y1 U. */
+	YUV_LAYOUT_YVYU,
+	/* Packed 4:2:2, one plane of U Y0 V Y1. */
+	YUV_LAYOUT_UYVY,
+	/* NV12 with 16-bit samples holding 10 bits in the high bits. */
+	YUV_LAYOUT_P010,
+	/* I420 with 16-bit samples holding 10 bits in the low bits. */
+	YUV_LAYOUT_I010,
+};
+
+/* What a conversion was made for. color_matrix is the frame's row-major
+ * YUV -> RGB matrix on normalized values, range included. */
+struct yuv_colorimetry {
+	yuv_layout layout;
+	float color_matrix[16];
+	bool full_range;
+};
+
+bool same_colorimetry(const yuv_colorimetry &a, const yuv_colorimetry &b);
+
+/* An overlay converted to one YUV layout, opacity included, with samples
+ * of the layout's depth (u and v are 8- or 16-bit to match). Subsampled
+ * chroma averages 2x2 blocks (2x1 for packed 4:2:2) whose alignment depends
+ * on the parity of the draw position, so it is kept per phase
+ * (x & 1 | (y & 1) << 1) and built on first use. NV12 and P010 store
+ * interleaved UV in chroma[phase][0]; the other layouts store U and V in
+ * chroma[phase][0] and [1], I444 in phase 0 only. */
+struct yuv_overlay {
+	yuv_colorimetry colorimetry;
+
+	cv::Mat u;
+	cv::Mat v;
+	cv::Mat alpha;
+
+	prepared_plane luma;
+	prepared_plane chroma[4][2];
+	bool chroma_ready[4] = {};
+};
+
+/* Converts a BGRA overlay to YUV with the inverse of the frame's color
+ * matrix. Fails if the matrix cannot be inverted. */
+bool convert_overlay_yuv(const cv::Mat &overlay_bgra, float opacity,
+		const yuv_colorimetry &colorimetry, yuv_overlay *out);
+
+/* Blends a converted overlay into the planes of a frame at (dst_x, dst_y)
+ * in luma coordinates, clipped to the frame. Builds the chroma phase for
+ * that position if it is not cached yet. */
+void blend_overlay_yuv(uint8_t *const planes[], const uint32_t linesize[],
+		int frame_w, int frame_h, yuv_overlay &overlay, int dst_x, int dst_y);
+
+/* Blends copies of the overlay at each of `count` positions, one pass per
+ * plane and chroma phase. Where copies overlap the later one wins, except
+ * in the chroma of copies whose positions differ in parity. */
+void blend_overlay_yuv(uint8_t *const planes[], const uint32_t linesize[],
+		int frame_w, int frame_h, yuv_overlay &overlay, const cv::Point *positions, size_t count);
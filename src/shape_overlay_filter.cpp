@@ -1,41 +1,124 @@
 #include "shape_overlay_filter.h"
+#include "asset_loader.h"
+#include "detection_worker.h"
+#include "frame_luma.h"
+#include "overlay_blend.h"
+#include "overlay_yuv.h"
+#include "template_match.h"
+#include "tile_pool.h"
 
 #include <util/platform.h>
 
 #include <opencv2/core.hpp>
-#include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
 #include <algorithm>
-#include <mutex>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
 #include <string>
+#include <vector>
 
 #define BLOG_CHANNEL "shape-overlay"
 
-struct shape_overlay_filter_data {
-	obs_source_t *source;
-	std::mutex mutex;
-
-	std::string template_path;
-	std::string overlay_path;
-
-	cv::Mat template_gray;
-	cv::Mat overlay_bgra;
-	cv::Mat overlay_draw;
-
+/* Adaptive interval: the interval doubles with every steady detection, up
+ * to this many times and this long. A detection is steady when the match
+ * stays within ADAPTIVE_STILL_PX frame pixels and scores at least
+ * ADAPTIVE_SCORE_HEADROOM above the threshold. */
+static constexpr uint32_t ADAPTIVE_MAX_DOUBLINGS = 4;
+static constexpr uint64_t ADAPTIVE_MAX_INTERVAL_NS = 2000000000ull;
+static constexpr int ADAPTIVE_STILL_PX = 2;
+static constexpr float ADAPTIVE_SCORE_HEADROOM = 0.05f;
+
+/* Tracking margin, in frame pixels, of the first detection after the source
+ * comes back on air when no tracking margin is set. */
+static constexpr int WARM_START_MARGIN = 32;
+
+/* Detection and placement settings of one template -> overlay mapping. */
+struct mapping_settings {
 	float threshold = 0.8f;
-	uint32_t interval_ms = 100;
-	float opacity = 1.0f;
 	int offset_x = 0;
 	int offset_y = 0;
-	bool scale_overlay = true;
+};
+
+/* Settings read by the video thread on every frame. mappings is in the
+ * order of asset_params::mappings: the main mapping first. */
+struct filter_settings {
+	std::vector<mapping_settings> mappings;
+	uint32_t interval_ms = 100;
+	bool adaptive_interval = false;
+	float cpu_share = 0.1f;
+	int tracking_margin = 0;
+	match_engine engine = MATCH_ENGINE_AUTO;
+	uint32_t max_instances = 1;
+	uint32_t match_threads = 1;
 	bool only_when_matched = true;
+};
 
-	uint64_t last_detect_ts = 0;
+/* Video thread state of one mapping: where it was last found, valid for
+ * the template bank of `generation`, in frame pixels, and its overlay
+ * variants converted for YUV and RGBA frames on first draw. */
+struct mapping_state {
+	uint64_t generation = 0;
 	int last_x = 0;
 	int last_y = 0;
+	size_t last_variant = 0;
 	float last_score = 0.0f;
 	bool last_valid = false;
+	/* For a logo library, the logo the position refers to. */
+	size_t library_entry = 0;
+	/* Every copy found, strongest first; the first is last_x/last_y. */
+	cv::Point instances[DETECTION_MAX_INSTANCES];
+	size_t instance_count = 0;
+
+	std::shared_ptr<const mapping_assets> converted_from;
+	std::vector<std::unique_ptr<yuv_overlay>> yuv_overlays;
+	std::vector<std::unique_ptr<prepared_overlay>> rgba_overlays;
+};
+
+struct shape_overlay_filter_data {
+	obs_source_t *source;
+
+	/* Swapped in whole by update and the loader with std::atomic_store and
+	 * never modified once published, so the video thread picks up the
+	 * current ones with std::atomic_load and never waits for either. */
+	std::shared_ptr<const filter_settings> settings;
+	std::shared_ptr<const overlay_assets> assets;
+
+	asset_loader *loader = nullptr;
+	detection_worker *worker = nullptr;
+
+	/* Whether the parent source is on program and whether it is shown
+	 * anywhere, kept by the activate/deactivate and show/hide callbacks.
+	 * Detection is paused while both are false. */
+	std::atomic<bool> active{false};
+	std::atomic<bool> showing{false};
+
+	/* Only touched by the video thread. */
+	uint64_t result_seq = 0;
+	bool force_full_frame = false;
+	/* visibility_seeded: active/showing were read from the parent once, in
+	 * case the filter was added to a source that was already shown.
+	 * paused: detection is suspended. warm_start: the next job searches
+	 * around the last match first, even without a tracking margin. */
+	bool visibility_seeded = false;
+	bool paused = false;
+	bool warm_start = false;
+	/* Gray frame at the detection resolution; each job gets a view of its
+	 * top-left corner. The worker drops that view before it reports idle,
+	 * so the next job refills the same memory. */
+	cv::Mat gray_frame;
+	luma_scratch luma;
+
+	/* Smoothed CPU time of recent detections, and how many detections in
+	 * a row found the match steady. Drive the adaptive interval. */
+	uint64_t detect_cost_ns = 0;
+	uint32_t steady_count = 0;
+
+	uint64_t last_detect_ts = 0;
+	mapping_state mappings[DETECTION_MAX_MAPPINGS];
 	bool warned_format = false;
 };
 
@@ -45,47 +128,23 @@ static const char *shape_overlay_filter_get_name(void *unused)
 	return obs_module_text("ShapeOverlayFilter");
 }
 
-static cv::Mat load_template_gray(const std::string &path)
-{
-	if (path.empty()) {
-		return cv::Mat();
-	}
-
-	cv::Mat img = cv::imread(path, cv::IMREAD_GRAYSCALE);
-	return img;
-}
-
-static cv::Mat load_overlay_bgra(const std::string &path)
-{
-	if (path.empty()) {
-		return cv::Mat();
-	}
-
-	cv::Mat img = cv::imread(path, cv::IMREAD_UNCHANGED);
-	if (img.empty()) {
-		return img;
-	}
-
-	if (img.channels() == 4) {
-		return img;
-	}
-
-	cv::Mat converted;
-	if (img.channels() == 3) {
-		cv::cvtColor(img, converted, cv::COLOR_BGR2BGRA);
-	} else if (img.channels() == 1) {
-		cv::cvtColor(img, converted, cv::COLOR_GRAY2BGRA);
-	} else {
-		return cv::Mat();
-	}
-
-	return converted;
-}
-
 static void shape_overlay_filter_defaults(obs_data_t *settings)
 {
 	obs_data_set_default_double(settings, "threshold", 0.8);
 	obs_data_set_default_int(settings, "interval_ms", 100);
+	obs_data_set_default_bool(settings, "adaptive_interval", false);
+	obs_data_set_default_double(settings, "cpu_share", 10.0);
+	obs_data_set_default_int(settings, "pyramid_levels", 0);
+	obs_data_set_default_int(settings, "detect_resolution", 1);
+	obs_data_set_default_int(settings, "tracking_margin", 0);
+	obs_data_set_default_int(settings, "match_engine", MATCH_ENGINE_AUTO);
+	obs_data_set_default_int(settings, "max_instances", 1);
+	obs_data_set_default_int(settings, "match_threads", 1);
+	obs_data_set_default_double(settings, "scale_min", 100.0);
+	obs_data_set_default_double(settings, "scale_max", 100.0);
+	obs_data_set_default_double(settings, "scale_step", 5.0);
+	obs_data_set_default_double(settings, "angle_range", 0.0);
+	obs_data_set_default_double(settings, "angle_step", 2.0);
 	obs_data_set_default_double(settings, "opacity", 100.0);
 	obs_data_set_default_int(settings, "offset_x", 0);
 	obs_data_set_default_int(settings, "offset_y", 0);
@@ -103,11 +162,48 @@ static obs_properties_t *shape_overlay_filter_properties(void *unused)
 				OBS_PATH_FILE, "PNG files (*.png)", NULL);
 	obs_properties_add_path(props, "overlay_path", obs_module_text("OverlayPath"),
 				OBS_PATH_FILE, "PNG files (*.png)", NULL);
+	obs_properties_add_editable_list(props, "mappings", obs_module_text("Mappings"),
+				OBS_EDITABLE_LIST_TYPE_STRINGS, NULL, NULL);
 
 	obs_properties_add_float_slider(props, "threshold",
 				obs_module_text("Threshold"), 0.0, 1.0, 0.01);
 	obs_properties_add_int(props, "interval_ms",
 				obs_module_text("IntervalMs"), 0, 2000, 10);
+	obs_properties_add_bool(props, "adaptive_interval",
+				obs_module_text("AdaptiveInterval"));
+	obs_properties_add_float_slider(props, "cpu_share",
+				obs_module_text("CpuShare"), 1.0, 100.0, 1.0);
+	obs_properties_add_int_slider(props, "pyramid_levels",
+				obs_module_text("PyramidLevels"), 0, 4, 1);
+	obs_properties_add_int(props, "tracking_margin",
+				obs_module_text("TrackingMargin"), 0, 1024, 4);
+	obs_properties_add_int(props, "max_instances",
+				obs_module_text("MaxInstances"), 1, DETECTION_MAX_INSTANCES, 1);
+	obs_properties_add_int(props, "match_threads",
+				obs_module_text("MatchThreads"), 1, TILE_POOL_MAX_THREADS, 1);
+
+	obs_property_t *resolution = obs_properties_add_list(props, "detect_resolution",
+				obs_module_text("DetectResolution"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(resolution, obs_module_text("DetectResolution.Full"), 1);
+	obs_property_list_add_int(resolution, obs_module_text("DetectResolution.Half"), 2);
+	obs_property_list_add_int(resolution, obs_module_text("DetectResolution.Quarter"), 4);
+
+	obs_property_t *engine = obs_properties_add_list(props, "match_engine",
+				obs_module_text("MatchEngine"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(engine, obs_module_text("MatchEngine.Auto"), MATCH_ENGINE_AUTO);
+	obs_property_list_add_int(engine, obs_module_text("MatchEngine.Spatial"), MATCH_ENGINE_SPATIAL);
+	obs_property_list_add_int(engine, obs_module_text("MatchEngine.FFT"), MATCH_ENGINE_FFT);
+
+	obs_properties_add_float_slider(props, "scale_min",
+				obs_module_text("ScaleMin"), 25.0, 400.0, 1.0);
+	obs_properties_add_float_slider(props, "scale_max",
+				obs_module_text("ScaleMax"), 25.0, 400.0, 1.0);
+	obs_properties_add_float_slider(props, "scale_step",
+				obs_module_text("ScaleStep"), 1.0, 50.0, 1.0);
+	obs_properties_add_float_slider(props, "angle_range",
+				obs_module_text("AngleRange"), 0.0, 45.0, 0.5);
+	obs_properties_add_float_slider(props, "angle_step",
+				obs_module_text("AngleStep"), 0.5, 15.0, 0.5);
 	obs_properties_add_float_slider(props, "opacity",
 				obs_module_text("Opacity"), 0.0, 100.0, 1.0);
 	obs_properties_add_int(props, "offset_x",
@@ -122,43 +218,166 @@ static obs_properties_t *shape_overlay_filter_properties(void *unused)
 	return props;
 }
 
-static void shape_overlay_filter_update(void *data, obs_data_t *settings)
+static std::string trim(const std::string &text)
 {
-	shape_overlay_filter_data *filter = static_cast<shape_overlay_filter_data *>(data);
+	const size_t first = text.find_first_not_of(" \t");
+	if (first == std::string::npos) {
+		return std::string();
+	}
+	return text.substr(first, text.find_last_not_of(" \t") - first + 1);
+}
 
-	std::lock_guard<std::mutex> lock(filter->mutex);
+/* Parses one entry of the mapping list:
+ * "template.png|overlay.png[|threshold[|offset x|offset y]]". '|' cannot
+ * appear in Windows paths. Fields left out keep the values already in
+ * *settings. Fails if either path is missing. */
+static bool parse_mapping(const char *entry, mapping_paths *paths, mapping_settings *settings)
+{
+	std::vector<std::string> fields;
+	const std::string text = entry ? entry : "";
+	size_t start = 0;
+	for (;;) {
+		const size_t end = text.find('|', start);
+		fields.push_back(trim(text.substr(start, end - start)));
+		if (end == std::string::npos) {
+			break;
+		}
+		start = end + 1;
+	}
 
-	filter->template_path = obs_data_get_string(settings, "template_path");
-	filter->overlay_path = obs_data_get_string(settings, "overlay_path");
-	filter->threshold = static_cast<float>(obs_data_get_double(settings, "threshold"));
-	filter->interval_ms = static_cast<uint32_t>(obs_data_get_int(settings, "interval_ms"));
-	filter->opacity = static_cast<float>(obs_data_get_double(settings, "opacity") / 100.0);
-	filter->offset_x = static_cast<int>(obs_data_get_int(settings, "offset_x"));
-	filter->offset_y = static_cast<int>(obs_data_get_int(settings, "offset_y"));
-	filter->scale_overlay = obs_data_get_bool(settings, "scale_overlay");
-	filter->only_when_matched = obs_data_get_bool(settings, "only_when_matched");
+	if (fields.size() < 2 || fields[0].empty() || fields[1].empty()) {
+		return false;
+	}
+
+	paths->template_path = fields[0];
+	paths->overlay_path = fields[1];
+	if (fields.size() > 2 && !fields[2].empty()) {
+		settings->threshold = std::clamp(static_cast<float>(std::strtod(fields[2].c_str(), nullptr)),
+				0.0f, 1.0f);
+	}
+	if (fields.size() > 3 && !fields[3].empty()) {
+		settings->offset_x = static_cast<int>(std::strtol(fields[3].c_str(), nullptr, 10));
+	}
+	if (fields.size() > 4 && !fields[4].empty()) {
+		settings->offset_y = static_cast<int>(std::strtol(fields[4].c_str(), nullptr, 10));
+	}
+	return true;
+}
 
-	filter->opacity = std::clamp(filter->opacity, 0.0f, 1.0f);
-	filter->threshold = std::clamp(filter->threshold, 0.0f, 1.0f);
+/* Appends the additional mappings of the editable list after the main
+ * one, up to DETECTION_MAX_MAPPINGS in total. */
+static void read_mappings(obs_data_t *settings, const mapping_settings &defaults,
+		asset_params *params, filter_settings *current)
+{
+	obs_data_array_t *entries = obs_data_get_array(settings, "mappings");
+	if (!entries) {
+		return;
+	}
 
-	filter->template_gray = load_template_gray(filter->template_path);
-	filter->overlay_bgra = load_overlay_bgra(filter->overlay_path);
+	const size_t count = obs_data_array_count(entries);
+	for (size_t i = 0; i < count; ++i) {
+		obs_data_t *item = obs_data_array_item(entries, i);
+		const char *entry = obs_data_get_string(item, "value");
+
+		mapping_paths paths;
+		mapping_settings mapping = defaults;
+		if (!parse_mapping(entry, &paths, &mapping)) {
+			blog(LOG_WARNING, "[%s] Ignoring mapping \"%s\": expected template.png|overlay.png",
+				BLOG_CHANNEL, entry ? entry : "");
+		} else if (params->mappings.size() >= DETECTION_MAX_MAPPINGS) {
+			blog(LOG_WARNING, "[%s] Ignoring mapping \"%s\": at most %d mappings per filter",
+				BLOG_CHANNEL, entry, DETECTION_MAX_MAPPINGS);
+		} else {
+			params->mappings.push_back(std::move(paths));
+			current->mappings.push_back(mapping);
+		}
 
-	if (!filter->overlay_bgra.empty() && filter->scale_overlay && !filter->template_gray.empty()) {
-		cv::resize(filter->overlay_bgra, filter->overlay_draw,
-				cv::Size(filter->template_gray.cols, filter->template_gray.rows),
-				0.0, 0.0, cv::INTER_AREA);
-	} else {
-		filter->overlay_draw = filter->overlay_bgra;
+		obs_data_release(item);
 	}
 
-	filter->last_valid = false;
+	obs_data_array_release(entries);
+}
+
+static void shape_overlay_filter_update(void *data, obs_data_t *settings)
+{
+	shape_overlay_filter_data *filter = static_cast<shape_overlay_filter_data *>(data);
+
+	auto current = std::make_shared<filter_settings>();
+
+	mapping_settings main_mapping;
+	main_mapping.threshold = static_cast<float>(obs_data_get_double(settings, "threshold"));
+	main_mapping.offset_x = static_cast<int>(obs_data_get_int(settings, "offset_x"));
+	main_mapping.offset_y = static_cast<int>(obs_data_get_int(settings, "offset_y"));
+	main_mapping.threshold = std::clamp(main_mapping.threshold, 0.0f, 1.0f);
+
+	asset_params params;
+	params.mappings.push_back({obs_data_get_string(settings, "template_path"),
+			obs_data_get_string(settings, "overlay_path")});
+	current->mappings.push_back(main_mapping);
+	read_mappings(settings, main_mapping, &params, current.get());
+
+	params.scale_overlay = obs_data_get_bool(settings, "scale_overlay");
+	params.pyramid_levels = static_cast<int>(obs_data_get_int(settings, "pyramid_levels"));
+	params.detect_downscale = static_cast<int>(obs_data_get_int(settings, "detect_resolution"));
+	params.scale_min = static_cast<float>(obs_data_get_double(settings, "scale_min") / 100.0);
+	params.scale_max = static_cast<float>(obs_data_get_double(settings, "scale_max") / 100.0);
+	params.scale_step = static_cast<float>(obs_data_get_double(settings, "scale_step") / 100.0);
+	params.angle_range = static_cast<float>(obs_data_get_double(settings, "angle_range"));
+	params.angle_step = static_cast<float>(obs_data_get_double(settings, "angle_step"));
+	params.opacity = static_cast<float>(obs_data_get_double(settings, "opacity") / 100.0);
+
+	params.pyramid_levels = std::clamp(params.pyramid_levels, 0, 4);
+	params.detect_downscale = params.detect_downscale >= 4 ? 4 : params.detect_downscale >= 2 ? 2 : 1;
+	params.opacity = std::clamp(params.opacity, 0.0f, 1.0f);
+
+	const float scale_step = template_scale_step(params.scale_min, params.scale_max,
+			params.scale_step);
+	if (params.scale_min != params.scale_max && scale_step != params.scale_step) {
+		blog(LOG_INFO, "[%s] Scale step widened from %.2f%% to %.2f%% to cover %.0f%%-%.0f%%",
+			BLOG_CHANNEL, params.scale_step * 100.0f, scale_step * 100.0f,
+			std::min(params.scale_min, params.scale_max) * 100.0f,
+			std::max(params.scale_min, params.scale_max) * 100.0f);
+	}
+
+	const float angle_step = template_angle_step(params.angle_range, params.angle_step);
+	if (params.angle_range != 0.0f && angle_step != params.angle_step) {
+		blog(LOG_INFO, "[%s] Angle step widened from %.2f to %.2f degrees to cover +-%.1f degrees",
+			BLOG_CHANNEL, params.angle_step, angle_step, std::fabs(params.angle_range));
+	}
+
+	current->interval_ms = static_cast<uint32_t>(obs_data_get_int(settings, "interval_ms"));
+	current->adaptive_interval = obs_data_get_bool(settings, "adaptive_interval");
+	current->cpu_share = static_cast<float>(obs_data_get_double(settings, "cpu_share") / 100.0);
+	current->tracking_margin = static_cast<int>(obs_data_get_int(settings, "tracking_margin"));
+	current->engine = static_cast<match_engine>(obs_data_get_int(settings, "match_engine"));
+	current->max_instances = static_cast<uint32_t>(std::clamp<long long>(
+			obs_data_get_int(settings, "max_instances"), 1, DETECTION_MAX_INSTANCES));
+	current->match_threads = static_cast<uint32_t>(std::clamp<long long>(
+			obs_data_get_int(settings, "match_threads"), 1, TILE_POOL_MAX_THREADS));
+	current->only_when_matched = obs_data_get_bool(settings, "only_when_matched");
+
+	current->tracking_margin = std::max(current->tracking_margin, 0);
+	current->cpu_share = std::clamp(current->cpu_share, 0.01f, 1.0f);
+
+	std::atomic_store(&filter->settings, std::shared_ptr<const filter_settings>(std::move(current)));
+
+	/* Decoding and template preparation happen on the loader thread; frames
+	 * keep using the current assets until the new ones are swapped in. */
+	asset_loader_request(filter->loader, params);
+}
+
+static void shape_overlay_filter_assets_ready(void *data, std::shared_ptr<const overlay_assets> assets)
+{
+	shape_overlay_filter_data *filter = static_cast<shape_overlay_filter_data *>(data);
+	std::atomic_store(&filter->assets, std::move(assets));
 }
 
 static void *shape_overlay_filter_create(obs_data_t *settings, obs_source_t *source)
 {
 	shape_overlay_filter_data *filter = new shape_overlay_filter_data();
 	filter->source = source;
+	filter->worker = detection_worker_create();
+	filter->loader = asset_loader_create(shape_overlay_filter_assets_ready, filter);
 
 	shape_overlay_filter_update(filter, settings);
 	return filter;
@@ -167,89 +386,305 @@ static void *shape_overlay_filter_create(obs_data_t *settings, obs_source_t *sou
 static void shape_overlay_filter_destroy(void *data)
 {
 	shape_overlay_filter_data *filter = static_cast<shape_overlay_filter_data *>(data);
+
+	asset_loader_destroy(filter->loader);
+	detection_worker_destroy(filter->worker);
 	delete filter;
 }
 
-static bool detect_template(const cv::Mat &frame_gray, const cv::Mat &templ_gray,
-		float threshold, int *out_x, int *out_y, float *out_score)
+static void shape_overlay_filter_activate(void *data)
 {
-	if (frame_gray.empty() || templ_gray.empty()) {
-		return false;
+	static_cast<shape_overlay_filter_data *>(data)->active.store(true);
+}
+
+static void shape_overlay_filter_deactivate(void *data)
+{
+	static_cast<shape_overlay_filter_data *>(data)->active.store(false);
+}
+
+static void shape_overlay_filter_show(void *data)
+{
+	static_cast<shape_overlay_filter_data *>(data)->showing.store(true);
+}
+
+static void shape_overlay_filter_hide(void *data)
+{
+	static_cast<shape_overlay_filter_data *>(data)->showing.store(false);
+}
+
+/* How the pixels of a frame are read for detection and drawn into. */
+enum frame_kind {
+	FRAME_UNSUPPORTED,
+	FRAME_BGRA,
+	FRAME_RGBA,
+	FRAME_YUV,
+};
+
+static frame_kind classify_frame(video_format format, yuv_layout *layout)
+{
+	switch (format) {
+	case VIDEO_FORMAT_BGRA:
+	case VIDEO_FORMAT_BGRX:
+		return FRAME_BGRA;
+	case VIDEO_FORMAT_RGBA:
+		return FRAME_RGBA;
+	case VIDEO_FORMAT_NV12:
+		*layout = YUV_LAYOUT_NV12;
+		return FRAME_YUV;
+	case VIDEO_FORMAT_I420:
+		*layout = YUV_LAYOUT_I420;
+		return FRAME_YUV;
+	case VIDEO_FORMAT_I444:
+		*layout = YUV_LAYOUT_I444;
+		return FRAME_YUV;
+	case VIDEO_FORMAT_YUY2:
+		*layout = YUV_LAYOUT_YUY2;
+		return FRAME_YUV;
+	case VIDEO_FORMAT_YVYU:
+		*layout = YUV_LAYOUT_YVYU;
+		return FRAME_YUV;
+	case VIDEO_FORMAT_UYVY:
+		*layout = YUV_LAYOUT_UYVY;
+		return FRAME_YUV;
+	case VIDEO_FORMAT_P010:
+		*layout = YUV_LAYOUT_P010;
+		return FRAME_YUV;
+	case VIDEO_FORMAT_I010:
+		*layout = YUV_LAYOUT_I010;
+		return FRAME_YUV;
+	default:
+		return FRAME_UNSUPPORTED;
 	}
+}
 
-	if (templ_gray.cols > frame_gray.cols || templ_gray.rows > frame_gray.rows) {
-		return false;
+/* Grayscale copy of `region` of the frame, shrunk by `factor`, in one pass
+ * over frame memory; region is in detection pixels. YUV frames give their
+ * luma with no color conversion: TM_CCOEFF_NORMED ignores gain and offset,
+ * so limited-range luma matches a grayscale template as well as converted
+ * RGB would. 10-bit luma is narrowed to its top 8 bits, which is all the
+ * 8-bit template can match against. The copy is needed because the worker
+ * outlives the frame. */
+static void extract_gray(const obs_source_frame *frame, frame_kind kind, yuv_layout layout,
+		int factor, const cv::Rect &region, luma_scratch *scratch, cv::Mat &gray)
+{
+	const uint8_t *data = frame->data[0];
+	const uint32_t linesize = frame->linesize[0];
+
+	if (kind != FRAME_YUV) {
+		extract_gray_bgra(data, linesize, kind == FRAME_RGBA, factor, region, scratch, gray);
+		return;
+	}
+
+	switch (layout) {
+	case YUV_LAYOUT_YUY2:
+	case YUV_LAYOUT_YVYU:
+		extract_packed_luma(data, linesize, 0, factor, region, scratch, gray);
+		break;
+	case YUV_LAYOUT_UYVY:
+		extract_packed_luma(data, linesize, 1, factor, region, scratch, gray);
+		break;
+	case YUV_LAYOUT_P010:
+		extract_luma16(data, linesize, 8, factor, region, scratch, gray);
+		break;
+	case YUV_LAYOUT_I010:
+		extract_luma16(data, linesize, 2, factor, region, scratch, gray);
+		break;
+	default:
+		extract_luma8(data, linesize, factor, region, scratch, gray);
+		break;
 	}
+}
 
-	cv::Mat result;
-	cv::matchTemplate(frame_gray, templ_gray, result, cv::TM_CCOEFF_NORMED);
+/* Time from one detection to the next. The adaptive interval never goes
+ * below the set one or below what keeps detection within the CPU share,
+ * and doubles from there for every steady detection in a row, so a locked,
+ * still logo is checked rarely while a moving or fading one, or a search
+ * for a lost one, runs at full rate. */
+static uint64_t detection_interval_ns(const shape_overlay_filter_data *filter,
+		const filter_settings &settings)
+{
+	const uint64_t set_ns = static_cast<uint64_t>(settings.interval_ms) * 1000000ull;
+	if (!settings.adaptive_interval) {
+		return set_ns;
+	}
 
-	double min_val = 0.0;
-	double max_val = 0.0;
-	cv::Point min_loc;
-	cv::Point max_loc;
-	cv::minMaxLoc(result, &min_val, &max_val, &min_loc, &max_loc);
+	const uint64_t budget_ns = static_cast<uint64_t>(
+			static_cast<double>(filter->detect_cost_ns) / settings.cpu_share);
+	const uint64_t floor_ns = std::max(set_ns, budget_ns);
+	const uint64_t steady_ns = floor_ns << std::min(filter->steady_count, ADAPTIVE_MAX_DOUBLINGS);
+	return std::max(floor_ns, std::min(steady_ns, ADAPTIVE_MAX_INTERVAL_NS));
+}
 
-	if (out_score) {
-		*out_score = static_cast<float>(max_val);
+/* The plain mapping a lock refers to: the mapping itself, or for a logo
+ * library the logo identified last. Null if there is none. */
+static const std::shared_ptr<const mapping_assets> *tracked_mapping(
+		const std::shared_ptr<const mapping_assets> &mapping, const mapping_state &state)
+{
+	if (!mapping->library) {
+		return &mapping;
 	}
 
-	if (max_val >= threshold) {
-		if (out_x) {
-			*out_x = max_loc.x;
+	const logo_library &library = *mapping->library;
+	return state.library_entry < library.entries.size() ? &library.entries[state.library_entry]
+			: nullptr;
+}
+
+/* Folds a finished detection into the lock-on state of its mappings and
+ * into the cost and steadiness the adaptive interval is based on. Targets
+ * whose templates were replaced after the job was submitted are dropped;
+ * returns false if that leaves nothing. A detection is steady when every
+ * mapping it searched stayed put. */
+static bool apply_detection(shape_overlay_filter_data *filter, const filter_settings &settings,
+		const overlay_assets &assets, size_t mapping_count, const detection_result &result)
+{
+	bool current = false;
+	bool steady = !result.needs_full_frame;
+
+	for (size_t i = 0; i < result.target_count; ++i) {
+		const detection_target_result &target = result.targets[i];
+		if (target.mapping >= mapping_count ||
+				!assets.mappings[target.mapping]->usable() ||
+				assets.mappings[target.mapping]->generation() != target.generation) {
+			continue;
 		}
-		if (out_y) {
-			*out_y = max_loc.y;
+		current = true;
+		if (!target.searched) {
+			continue;
 		}
-		return true;
+
+		mapping_state &state = filter->mappings[target.mapping];
+		const int downscale = assets.mappings[target.mapping]->downscale();
+		const int x = target.match.x * downscale;
+		const int y = target.match.y * downscale;
+
+		steady = steady && target.matched && state.last_valid &&
+				target.library_entry == state.library_entry &&
+				target.instance_count == state.instance_count &&
+				target.match.variant_index == state.last_variant &&
+				std::abs(x - state.last_x) <= ADAPTIVE_STILL_PX &&
+				std::abs(y - state.last_y) <= ADAPTIVE_STILL_PX &&
+				target.match.score >= settings.mappings[target.mapping].threshold +
+						ADAPTIVE_SCORE_HEADROOM;
+
+		state.last_score = target.match.score;
+		if (target.matched) {
+			state.last_x = x;
+			state.last_y = y;
+			state.last_variant = target.match.variant_index;
+			state.library_entry = target.library_entry;
+			state.last_valid = true;
+			state.instance_count = target.instance_count;
+			for (size_t n = 0; n < target.instance_count; ++n) {
+				state.instances[n] = cv::Point(target.instances[n].x * downscale,
+						target.instances[n].y * downscale);
+			}
+		} else if (settings.only_when_matched) {
+			state.last_valid = false;
+		}
+	}
+
+	if (!current) {
+		return false;
+	}
+
+	filter->detect_cost_ns = filter->detect_cost_ns == 0
+			? result.cpu_ns
+			: (filter->detect_cost_ns * 3 + result.cpu_ns) / 4;
+	filter->steady_count = steady ? filter->steady_count + 1 : 0;
+	if (result.needs_full_frame) {
+		filter->force_full_frame = true;
 	}
+	return true;
+}
 
-	return false;
+/* Where the filtered source is shown, so the scheduler can serve program
+ * sources first. Only asked while not paused, so it is shown somewhere. */
+static detection_priority source_priority(const shape_overlay_filter_data *filter)
+{
+	return filter->active.load() ? DETECTION_PRIORITY_PROGRAM : DETECTION_PRIORITY_PREVIEW;
 }
 
-static void blend_overlay_bgra(uint8_t *dst, uint32_t dst_linesize,
-		int frame_w, int frame_h, const cv::Mat &overlay,
-		int dst_x, int dst_y, float opacity)
+/* Suspends detection while the source is neither on program nor shown,
+ * dropping a job still waiting for the pool. When it comes back the locks
+ * are kept and the next detection runs at once, starting around the last
+ * matches. Returns true while paused. */
+static bool update_paused(shape_overlay_filter_data *filter)
 {
-	if (overlay.empty()) {
-		return;
+	if (!filter->visibility_seeded) {
+		const obs_source_t *parent = obs_filter_get_parent(filter->source);
+		if (parent) {
+			filter->active.store(obs_source_active(parent));
+			filter->showing.store(obs_source_showing(parent));
+		}
+		filter->visibility_seeded = true;
 	}
 
-	const int overlay_w = overlay.cols;
-	const int overlay_h = overlay.rows;
+	const bool paused = !filter->active.load() && !filter->showing.load();
+	if (paused && !filter->paused) {
+		detection_worker_cancel(filter->worker);
+	} else if (!paused && filter->paused) {
+		filter->last_detect_ts = 0;
+		filter->steady_count = 0;
+		filter->warm_start = std::any_of(std::begin(filter->mappings), std::end(filter->mappings),
+				[](const mapping_state &state) { return state.last_valid; });
+	}
 
-	int start_x = std::max(0, dst_x);
-	int start_y = std::max(0, dst_y);
-	int end_x = std::min(frame_w, dst_x + overlay_w);
-	int end_y = std::min(frame_h, dst_y + overlay_h);
+	filter->paused = paused;
+	return paused;
+}
 
-	if (start_x >= end_x || start_y >= end_y) {
+/* Drops overlays converted for an older version of the mapping. */
+static void sync_converted_overlays(mapping_state *state,
+		const std::shared_ptr<const mapping_assets> &mapping)
+{
+	if (state->converted_from == mapping) {
 		return;
 	}
 
-	const int overlay_x0 = start_x - dst_x;
-	const int overlay_y0 = start_y - dst_y;
-
-	for (int oy = overlay_y0, fy = start_y; fy < end_y; ++fy, ++oy) {
-		const uint8_t *src_row = overlay.ptr<uint8_t>(oy);
-		uint8_t *dst_row = dst + (static_cast<size_t>(fy) * dst_linesize);
-
-		for (int ox = overlay_x0, fx = start_x; fx < end_x; ++fx, ++ox) {
-			const uint8_t *src_px = src_row + (static_cast<size_t>(ox) * 4u);
-			uint8_t *dst_px = dst_row + (static_cast<size_t>(fx) * 4u);
+	state->converted_from = mapping;
+	state->yuv_overlays.clear();
+	state->yuv_overlays.resize(mapping->overlay_variants.size());
+	state->rgba_overlays.clear();
+	state->rgba_overlays.resize(mapping->overlay_variants.size());
+}
 
-			const int src_alpha = static_cast<int>(static_cast<float>(src_px[3]) * opacity + 0.5f);
-			if (src_alpha <= 0) {
-				continue;
-			}
+/* The overlay variant converted for the colorimetry of the current frame,
+ * converted again only when the mapping or the colorimetry change. */
+static yuv_overlay *get_yuv_overlay(mapping_state *state,
+		const std::shared_ptr<const mapping_assets> &mapping, float opacity, size_t variant,
+		const yuv_colorimetry &colorimetry)
+{
+	sync_converted_overlays(state, mapping);
+
+	std::unique_ptr<yuv_overlay> &converted = state->yuv_overlays[variant];
+	if (!converted || !same_colorimetry(converted->colorimetry, colorimetry)) {
+		converted = std::make_unique<yuv_overlay>();
+		if (!convert_overlay_yuv(mapping->overlay_variants[variant].image, opacity,
+				colorimetry, converted.get())) {
+			blog(LOG_WARNING, "[%s] Cannot convert the overlay: frame color matrix is not invertible",
+				BLOG_CHANNEL);
+		}
+	}
+	return converted.get();
+}
 
-			const int inv_alpha = 255 - src_alpha;
-			dst_px[0] = static_cast<uint8_t>((src_px[0] * src_alpha + dst_px[0] * inv_alpha + 127) / 255);
-			dst_px[1] = static_cast<uint8_t>((src_px[1] * src_alpha + dst_px[1] * inv_alpha + 127) / 255);
-			dst_px[2] = static_cast<uint8_t>((src_px[2] * src_alpha + dst_px[2] * inv_alpha + 127) / 255);
-			dst_px[3] = 255;
+/* The overlay variant with red and blue swapped for RGBA frames. */
+static const prepared_overlay *get_rgba_overlay(mapping_state *state,
+		const std::shared_ptr<const mapping_assets> &mapping, float opacity, size_t variant)
+{
+	sync_converted_overlays(state, mapping);
+
+	std::unique_ptr<prepared_overlay> &converted = state->rgba_overlays[variant];
+	if (!converted) {
+		converted = std::make_unique<prepared_overlay>();
+		const cv::Mat &image = mapping->overlay_variants[variant].image;
+		if (!image.empty()) {
+			cv::Mat rgba;
+			cv::cvtColor(image, rgba, cv::COLOR_BGRA2RGBA);
+			prepare_overlay(rgba, opacity, converted.get());
 		}
 	}
+	return converted.get();
 }
 
 static obs_source_frame *shape_overlay_filter_video(void *data, obs_source_frame *frame)
@@ -260,100 +695,190 @@ static obs_source_frame *shape_overlay_filter_video(void *data, obs_source_frame
 
 	shape_overlay_filter_data *filter = static_cast<shape_overlay_filter_data *>(data);
 
-	if (frame->format != VIDEO_FORMAT_BGRA && frame->format != VIDEO_FORMAT_BGRX) {
+	yuv_layout layout = YUV_LAYOUT_NV12;
+	const frame_kind kind = classify_frame(frame->format, &layout);
+	if (kind == FRAME_UNSUPPORTED) {
 		if (!filter->warned_format) {
-			blog(LOG_WARNING, "[%s] Unsupported frame format: %d (expected BGRA/BGRX)",
+			blog(LOG_WARNING, "[%s] Unsupported frame format: %d (expected BGRA/BGRX, RGBA, NV12, I420, I444, YUY2, YVYU, UYVY, P010 or I010)",
 				BLOG_CHANNEL, frame->format);
 			filter->warned_format = true;
 		}
 		return frame;
 	}
 
-	cv::Mat template_gray;
-	cv::Mat overlay_draw;
-	float threshold = 0.0f;
-	float opacity = 1.0f;
-	uint32_t interval_ms = 0;
-	int offset_x = 0;
-	int offset_y = 0;
-	bool only_when_matched = true;
-
-	uint64_t last_detect_ts = 0;
-	int last_x = 0;
-	int last_y = 0;
-	bool last_valid = false;
-	float last_score = 0.0f;
+	const std::shared_ptr<const filter_settings> settings = std::atomic_load(&filter->settings);
+	const std::shared_ptr<const overlay_assets> assets = std::atomic_load(&filter->assets);
+	if (!settings || !assets) {
+		return frame;
+	}
 
-	{
-		std::lock_guard<std::mutex> lock(filter->mutex);
-		template_gray = filter->template_gray;
-		overlay_draw = filter->overlay_draw;
-		threshold = filter->threshold;
-		opacity = filter->opacity;
-		interval_ms = filter->interval_ms;
-		offset_x = filter->offset_x;
-		offset_y = filter->offset_y;
-		only_when_matched = filter->only_when_matched;
-
-		last_detect_ts = filter->last_detect_ts;
-		last_x = filter->last_x;
-		last_y = filter->last_y;
-		last_valid = filter->last_valid;
-		last_score = filter->last_score;
-	}
-
-	if (template_gray.empty() || overlay_draw.empty()) {
+	/* Settings and assets are swapped separately, so a frame may briefly
+	 * see different mapping counts in them. */
+	const size_t mapping_count = std::min({settings->mappings.size(), assets->mappings.size(),
+			static_cast<size_t>(DETECTION_MAX_MAPPINGS)});
+
+	/* A new overlay alone keeps a mapping's lock; new templates invalidate
+	 * the position and variant it refers to. Detection works in frame pixels
+	 * divided by downscale, the same for every bank of a bundle;
+	 * last_x/last_y stay in frame pixels. */
+	int downscale = 0;
+	for (size_t i = 0; i < mapping_count; ++i) {
+		const mapping_assets &mapping = *assets->mappings[i];
+		mapping_state &state = filter->mappings[i];
+		if (!mapping.usable()) {
+			state.last_valid = false;
+			continue;
+		}
+		downscale = mapping.downscale();
+		if (state.generation != mapping.generation()) {
+			state.generation = mapping.generation();
+			state.last_valid = false;
+		}
+	}
+	if (downscale == 0) {
 		return frame;
 	}
 
+	/* The next detection is timed from when this one actually ran, so
+	 * filters whose jobs waited in the queue stay spread out instead of all
+	 * becoming due on the same frame again. */
+	detection_result result;
+	if (detection_worker_poll(filter->worker, &filter->result_seq, &result) &&
+			apply_detection(filter, *settings, *assets, mapping_count, result)) {
+		filter->last_detect_ts = result.start_ts;
+	}
+
+	const bool paused = update_paused(filter);
 	const uint64_t now = os_gettime_ns();
-	const uint64_t interval_ns = static_cast<uint64_t>(interval_ms) * 1000000ull;
-	const bool should_detect = (interval_ms == 0) || (now - last_detect_ts >= interval_ns);
-	bool state_updated = false;
-
-	if (should_detect) {
-		cv::Mat frame_bgra(frame->height, frame->width, CV_8UC4, frame->data[0], frame->linesize[0]);
-		cv::Mat frame_gray;
-		cv::cvtColor(frame_bgra, frame_gray, cv::COLOR_BGRA2GRAY);
-
-		float score = 0.0f;
-		int found_x = 0;
-		int found_y = 0;
-		bool matched = detect_template(frame_gray, template_gray, threshold,
-				&found_x, &found_y, &score);
-
-		last_score = score;
-		if (matched) {
-			last_x = found_x;
-			last_y = found_y;
-			last_valid = true;
-		} else if (only_when_matched) {
-			last_valid = false;
+	const uint64_t interval_ns = detection_interval_ns(filter, *settings);
+	const bool should_detect = filter->force_full_frame || (interval_ns == 0) ||
+			(now - filter->last_detect_ts >= interval_ns);
+
+	if (should_detect && !paused && !detection_worker_busy(filter->worker)) {
+		const cv::Size detect_size(static_cast<int>(frame->width) / downscale,
+				static_cast<int>(frame->height) / downscale);
+		const int frame_margin = settings->tracking_margin > 0 ? settings->tracking_margin
+				: filter->warm_start ? WARM_START_MARGIN : 0;
+		const int margin = (frame_margin + downscale - 1) / downscale;
+
+		detection_job job;
+		job.target_count = 0;
+
+		/* While every mapping is locked on, only the area spanning their
+		 * tracking windows is handed over. */
+		bool windowed = !filter->force_full_frame && margin > 0;
+		cv::Rect windows;
+		for (size_t i = 0; i < mapping_count; ++i) {
+			const std::shared_ptr<const mapping_assets> &mapping = assets->mappings[i];
+			if (!mapping->usable()) {
+				continue;
+			}
+
+			/* A library without a logo identified yet has no bank to
+			 * track; the worker searches the whole library. */
+			const mapping_state &state = filter->mappings[i];
+			const std::shared_ptr<const mapping_assets> *tracked = tracked_mapping(mapping, state);
+			const std::shared_ptr<const template_bank> templates =
+					tracked && (state.last_valid || !mapping->library)
+							? (*tracked)->templates : nullptr;
+
+			detection_target &target = job.targets[job.target_count++];
+			target.mapping = i;
+			target.templates = templates;
+			target.library = mapping->library ? mapping->library->index : nullptr;
+			target.library_entry = state.library_entry;
+			target.threshold = settings->mappings[i].threshold;
+			target.max_instances = settings->max_instances;
+			target.last_valid = state.last_valid;
+			target.last_x = state.last_x / downscale;
+			target.last_y = state.last_y / downscale;
+			target.last_variant = state.last_variant;
+
+			if (!windowed) {
+				continue;
+			}
+			cv::Rect window;
+			if (templates && state.last_valid && state.last_variant < templates->size() &&
+					settings->max_instances == 1) {
+				window = tracking_window(target.last_x, target.last_y,
+						templates->variants[state.last_variant].pyramid[0].size(),
+						margin, detect_size);
+			}
+			if (window.empty()) {
+				windowed = false;
+			} else {
+				windows = windows.empty() ? window : (windows | window);
+			}
 		}
 
-		last_detect_ts = now;
-		state_updated = true;
-	}
+		const cv::Rect region = windowed ? windows
+				: cv::Rect(0, 0, detect_size.width, detect_size.height);
+
+		filter->gray_frame.create(detect_size.height, detect_size.width, CV_8UC1);
+
+		job.frame_gray = filter->gray_frame(cv::Rect(0, 0, region.width, region.height));
+		extract_gray(frame, kind, layout, downscale, region, &filter->luma, job.frame_gray);
+		job.region = region;
+		job.frame_size = detect_size;
+		job.priority = source_priority(filter);
+		job.tracking_margin = margin;
+		job.engine = settings->engine;
+		job.match_threads = settings->match_threads;
 
-	if (state_updated) {
-		std::lock_guard<std::mutex> lock(filter->mutex);
-		filter->last_detect_ts = last_detect_ts;
-		filter->last_x = last_x;
-		filter->last_y = last_y;
-		filter->last_valid = last_valid;
-		filter->last_score = last_score;
+		if (detection_worker_submit(filter->worker, std::move(job))) {
+			filter->force_full_frame = false;
+			filter->warm_start = false;
+			filter->last_detect_ts = now;
+		}
 	}
 
-	if (!last_valid) {
-		return frame;
+	yuv_colorimetry colorimetry;
+	if (kind == FRAME_YUV) {
+		colorimetry.layout = layout;
+		std::copy(std::begin(frame->color_matrix), std::end(frame->color_matrix),
+				colorimetry.color_matrix);
+		colorimetry.full_range = frame->full_range;
 	}
 
-	const int draw_x = last_x + offset_x;
-	const int draw_y = last_y + offset_y;
+	for (size_t i = 0; i < mapping_count; ++i) {
+		mapping_state &state = filter->mappings[i];
+		const std::shared_ptr<const mapping_assets> *tracked =
+				tracked_mapping(assets->mappings[i], state);
+		if (!state.last_valid || !tracked) {
+			continue;
+		}
+
+		const std::shared_ptr<const mapping_assets> &mapping = *tracked;
+		const size_t last_variant = state.last_variant;
+		if (last_variant >= mapping->overlay_variants.size()) {
+			continue;
+		}
 
-	blend_overlay_bgra(frame->data[0], frame->linesize[0],
-			frame->width, frame->height,
-			overlay_draw, draw_x, draw_y, opacity);
+		/* Every copy shares the variant, so all are drawn in one pass. */
+		const overlay_variant &overlay = mapping->overlay_variants[last_variant];
+		const cv::Point shift(overlay.anchor.x + settings->mappings[i].offset_x,
+				overlay.anchor.y + settings->mappings[i].offset_y);
+		cv::Point positions[DETECTION_MAX_INSTANCES];
+		for (size_t n = 0; n < state.instance_count; ++n) {
+			positions[n] = state.instances[n] + shift;
+		}
+
+		if (kind == FRAME_BGRA) {
+			blend_overlay_bgra(frame->data[0], frame->linesize[0],
+					frame->width, frame->height,
+					overlay.prepared, positions, state.instance_count);
+		} else if (kind == FRAME_RGBA) {
+			blend_overlay_bgra(frame->data[0], frame->linesize[0],
+					frame->width, frame->height,
+					*get_rgba_overlay(&state, mapping, assets->params.opacity, last_variant),
+					positions, state.instance_count);
+		} else {
+			yuv_overlay *converted = get_yuv_overlay(&state, mapping, assets->params.opacity,
+					last_variant, colorimetry);
+			blend_overlay_yuv(frame->data, frame->linesize, frame->width, frame->height,
+					*converted, positions, state.instance_count);
+		}
+	}
 
 	return frame;
 }
@@ -368,5 +893,9 @@ struct obs_source_info shape_overlay_filter = {
 	.get_defaults = shape_overlay_filter_defaults,
 	.get_properties = shape_overlay_filter_properties,
 	.update = shape_overlay_filter_update,
+	.activate = shape_overlay_filter_activate,
+	.deactivate = shape_overlay_filter_deactivate,
+	.show = shape_overlay_filter_show,
+	.hide = shape_overlay_filter_hide,
 	.filter_video = shape_overlay_filter_video,
 };
@@ -0,0 +1,961 @@
+#include "template_match.h"
+#include "tile_pool.h"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+/* Smallest template side allowed at the coarsest level. Below this the
+ * normalized correlation gets too noisy to pick reliable candidates. */
+static constexpr int PYRAMID_MIN_TEMPLATE_SIDE = 12;
+
+/* Candidates carried from the coarsest level into refinement. More than one
+ * so a repeated pattern or a blurry coarse level cannot steal the match. */
+static constexpr size_t PYRAMID_CANDIDATES = 3;
+
+/* Pixels searched on each side of an upsampled candidate. pyrDown rounds odd
+ * sizes up, so a candidate can drift by one pixel per level. */
+static constexpr int PYRAMID_REFINE_MARGIN = 2;
+
+/* Only every Nth scale and angle is ranked on the first pass; the N - 1
+ * neighbours on either side of the winner are ranked afterwards. */
+static constexpr size_t SCALE_COARSE_STRIDE = 3;
+static constexpr size_t ANGLE_COARSE_STRIDE = 3;
+
+/* Coarse peaks kept per requested instance, and how far below the threshold
+ * they may score. Coarse levels blur the template, so scores there run
+ * lower than at full resolution, where the threshold is applied. */
+static constexpr size_t INSTANCE_COARSE_FACTOR = 2;
+static constexpr float INSTANCE_COARSE_SLACK = 0.15f;
+
+/* Spatial result maps larger than this are computed and reduced in bands of
+ * result rows instead of whole, so a 4K search does not write and re-read a
+ * map of tens of megabytes. A band has at least STREAM_BAND_ROWS rows and
+ * STREAM_BAND_TEMPLATES template heights, which keeps the frame rows that
+ * neighbouring bands both read to a fraction of the work. A search split
+ * across threads cuts its tiles thinner, down to one per thread, as long
+ * as they keep STREAM_TILE_TEMPLATES template heights: an idle thread costs
+ * more than the rows thinner tiles correlate twice. */
+static constexpr size_t STREAM_WHOLE_BYTES = 1u << 20;
+static constexpr int STREAM_BAND_ROWS = 64;
+static constexpr int STREAM_BAND_TEMPLATES = 4;
+static constexpr int STREAM_TILE_TEMPLATES = 2;
+
+/* Local peaks a scan keeps for suppression: the strongest PEAK_POOL_FACTOR
+ * per peak asked for, and at least PEAK_POOL_MIN. */
+static constexpr size_t PEAK_POOL_FACTOR = 8;
+static constexpr size_t PEAK_POOL_MIN = 64;
+
+/* Upper bounds on bank size so a tiny step cannot blow up update time. A
+ * step that would need more entries is widened to cover the whole range. */
+static constexpr size_t SCALE_MAX_ENTRIES = 64;
+static constexpr size_t ANGLE_MAX_ENTRIES = 31;
+static constexpr float SCALE_MIN_STEP = 0.01f;
+static constexpr float ANGLE_MIN_STEP = 0.25f;
+
+static void build_template_pyramid(const cv::Mat &templ_gray, const cv::Mat &mask,
+		int max_levels, template_variant *variant)
+{
+	variant->pyramid.clear();
+	variant->mask_pyramid.clear();
+	variant->pyramid.push_back(templ_gray);
+	if (!mask.empty()) {
+		variant->mask_pyramid.push_back(mask);
+	}
+
+	for (int level = 1; level <= max_levels; ++level) {
+		cv::Mat next;
+		cv::pyrDown(variant->pyramid.back(), next);
+		if (std::min(next.cols, next.rows) < PYRAMID_MIN_TEMPLATE_SIDE) {
+			break;
+		}
+		variant->pyramid.push_back(next);
+
+		if (!mask.empty()) {
+			/* Only keep pixels that were fully inside at the finer level. */
+			cv::Mat next_mask;
+			cv::pyrDown(variant->mask_pyramid.back(), next_mask);
+			cv::threshold(next_mask, next_mask, 254.0, 255.0, cv::THRESH_BINARY);
+			variant->mask_pyramid.push_back(next_mask);
+		}
+	}
+}
+
+void rotate_image(const cv::Mat &src, const cv::Point2f &pivot, float angle, int interpolation,
+		cv::Mat &dst, cv::Point2f *origin)
+{
+	cv::Mat rot = cv::getRotationMatrix2D(pivot, angle, 1.0);
+
+	const double a = rot.at<double>(0, 0);
+	const double b = rot.at<double>(0, 1);
+	const double tx = rot.at<double>(0, 2);
+	const double c = rot.at<double>(1, 0);
+	const double d = rot.at<double>(1, 1);
+	const double ty = rot.at<double>(1, 2);
+
+	double min_x = std::numeric_limits<double>::max();
+	double min_y = std::numeric_limits<double>::max();
+	double max_x = std::numeric_limits<double>::lowest();
+	double max_y = std::numeric_limits<double>::lowest();
+	const double corners[4][2] = {{0.0, 0.0}, {static_cast<double>(src.cols), 0.0},
+			{0.0, static_cast<double>(src.rows)},
+			{static_cast<double>(src.cols), static_cast<double>(src.rows)}};
+	for (const auto &pt : corners) {
+		const double x = a * pt[0] + b * pt[1] + tx;
+		const double y = c * pt[0] + d * pt[1] + ty;
+		min_x = std::min(min_x, x);
+		min_y = std::min(min_y, y);
+		max_x = std::max(max_x, x);
+		max_y = std::max(max_y, y);
+	}
+
+	const double left = std::floor(min_x);
+	const double top = std::floor(min_y);
+	const cv::Size size(static_cast<int>(std::ceil(max_x) - left),
+			static_cast<int>(std::ceil(max_y) - top));
+
+	rot.at<double>(0, 2) -= left;
+	rot.at<double>(1, 2) -= top;
+	cv::warpAffine(src, dst, rot, size, interpolation, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+
+	if (origin) {
+		*origin = cv::Point2f(static_cast<float>(left), static_cast<float>(top));
+	}
+}
+
+static void build_variant(const cv::Mat &scaled, float scale, float angle, int pyramid_levels,
+		template_variant *variant)
+{
+	variant->scale = scale;
+	variant->angle = angle;
+	variant->base_size = scaled.size();
+	variant->origin = cv::Point2f(0.0f, 0.0f);
+
+	if (angle == 0.0f) {
+		build_template_pyramid(scaled, cv::Mat(), pyramid_levels, variant);
+		return;
+	}
+
+	const cv::Point2f pivot(scaled.cols * 0.5f, scaled.rows * 0.5f);
+
+	cv::Mat rotated;
+	rotate_image(scaled, pivot, angle, cv::INTER_LINEAR, rotated, &variant->origin);
+
+	/* Edge pixels are blended with the zero border, so only pixels the
+	 * template covers completely take part in the match. */
+	cv::Mat coverage(scaled.size(), CV_8UC1, cv::Scalar(255));
+	cv::Mat mask;
+	rotate_image(coverage, pivot, angle, cv::INTER_LINEAR, mask, nullptr);
+	cv::threshold(mask, mask, 254.0, 255.0, cv::THRESH_BINARY);
+
+	build_template_pyramid(rotated, mask, pyramid_levels, variant);
+}
+
+/* The requested step, at least min_step, and widened where needed so that
+ * first to last fits in max_count entries. */
+static float fit_step(float first, float last, float step, float min_step, size_t max_count)
+{
+	step = std::max(step, min_step);
+	if (max_count > 1 && (last - first) / step + 0.5f >= static_cast<float>(max_count)) {
+		step = (last - first) / static_cast<float>(max_count - 1);
+	}
+	return step;
+}
+
+/* Entries from first to last, step apart. The last entry is always `last`,
+ * even where the step does not divide the range or exceeds it. */
+static void build_steps(float first, float last, float step, std::vector<float> &out)
+{
+	out.clear();
+
+	size_t count = static_cast<size_t>((last - first) / step + 0.5f) + 1;
+	if (last > first) {
+		count = std::max<size_t>(count, 2);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		out.push_back(std::min(first + static_cast<float>(i) * step, last));
+	}
+	if (count > 1) {
+		out.back() = last;
+	}
+}
+
+float template_scale_step(float scale_min, float scale_max, float scale_step)
+{
+	return fit_step(std::min(scale_min, scale_max), std::max(scale_min, scale_max), scale_step,
+			SCALE_MIN_STEP, SCALE_MAX_ENTRIES);
+}
+
+float template_angle_step(float angle_range, float angle_step)
+{
+	angle_range = std::fabs(angle_range);
+	return fit_step(-angle_range, angle_range, angle_step, ANGLE_MIN_STEP, ANGLE_MAX_ENTRIES);
+}
+
+void build_template_bank(const cv::Mat &source_gray, float scale_min, float scale_max,
+		float scale_step, float angle_range, float angle_step, int pyramid_levels,
+		int downscale, template_bank &out_bank)
+{
+	static std::atomic<uint64_t> next_generation{1};
+
+	out_bank.variants.clear();
+	out_bank.angle_count = 1;
+	out_bank.downscale = std::max(downscale, 1);
+	out_bank.generation = next_generation++;
+	if (source_gray.empty()) {
+		return;
+	}
+
+	/* Same box average the frame goes through. */
+	cv::Mat templ_gray = source_gray;
+	if (out_bank.downscale > 1) {
+		const cv::Size size(source_gray.cols / out_bank.downscale,
+				source_gray.rows / out_bank.downscale);
+		if (size.width < 1 || size.height < 1) {
+			return;
+		}
+		cv::resize(source_gray, templ_gray, size, 0.0, 0.0, cv::INTER_AREA);
+	}
+
+	if (scale_max < scale_min) {
+		std::swap(scale_min, scale_max);
+	}
+
+	std::vector<float> scales;
+	build_steps(scale_min, scale_max, template_scale_step(scale_min, scale_max, scale_step),
+			scales);
+
+	std::vector<float> angles;
+	angle_range = std::fabs(angle_range);
+	if (angle_range > 0.0f) {
+		build_steps(-angle_range, angle_range, template_angle_step(angle_range, angle_step),
+				angles);
+	} else {
+		angles.push_back(0.0f);
+	}
+	out_bank.angle_count = angles.size();
+
+	for (float scale : scales) {
+		const cv::Size size(static_cast<int>(std::lround(templ_gray.cols * scale)),
+				static_cast<int>(std::lround(templ_gray.rows * scale)));
+		if (size.width < 1 || size.height < 1) {
+			continue;
+		}
+
+		cv::Mat scaled = templ_gray;
+		if (size != templ_gray.size()) {
+			cv::resize(templ_gray, scaled, size, 0.0, 0.0,
+					scale < 1.0f ? cv::INTER_AREA : cv::INTER_LINEAR);
+		}
+
+		for (float angle : angles) {
+			template_variant variant;
+			build_variant(scaled, scale, angle, pyramid_levels, &variant);
+			out_bank.variants.push_back(std::move(variant));
+		}
+	}
+}
+
+/* What to keep of a result map: its best `count` local peaks scoring at
+ * least min_score, after greedy non-maximum suppression. Peaks are taken
+ * strongest first, and each is dropped if it lies closer than min_dx and
+ * min_dy to one already kept. Masked correlation is undefined where the
+ * masked window is flat, so non-finite entries are always skipped. */
+struct peak_query {
+	size_t count;
+	int min_dx;
+	int min_dy;
+	float min_score;
+	bool masked;
+};
+
+/* Just the best entry. Ties keep the first entry in row order, as
+ * minMaxLoc does. */
+static peak_query best_query(bool masked)
+{
+	return {1, 1, 1, -std::numeric_limits<float>::infinity(), masked};
+}
+
+/* Whether only the single best entry is wanted, which minMaxLoc finds
+ * without looking at neighbours. */
+static bool best_only(const peak_query &q)
+{
+	return q.count == 1 && q.min_dx == 1 && q.min_dy == 1 && !q.masked;
+}
+
+static size_t peak_pool_size(const peak_query &q)
+{
+	return std::max(PEAK_POOL_MIN, q.count * PEAK_POOL_FACTOR);
+}
+
+/* Score order; equal scores keep row order, as minMaxLoc does. */
+static bool stronger_peak(const match_candidate &a, const match_candidate &b)
+{
+	if (a.score != b.score) {
+		return a.score > b.score;
+	}
+	return a.y != b.y ? a.y < b.y : a.x < b.x;
+}
+
+/* Keeps the `size` strongest peaks of pool, in no particular order. */
+static void trim_peaks(std::vector<match_candidate> &pool, size_t size)
+{
+	if (pool.size() > size) {
+		std::nth_element(pool.begin(), pool.begin() + static_cast<std::ptrdiff_t>(size),
+				pool.end(), stronger_peak);
+		pool.resize(size);
+	}
+}
+
+/* Adds the local peaks of rows [begin, end) of a result map, or of a band
+ * of it whose rows start at result row first_row, to pool. A peak scores
+ * at least as high as its finite neighbours, so the band should hold the
+ * row above and below those rows where the map has them. The pool is
+ * trimmed to the strongest peak_pool_size(q) as it fills, which keeps it
+ * bounded and drops nothing suppress_peaks could still use, unless the
+ * peaks it keeps run out before q.count of them survive. */
+static void collect_peaks(const cv::Mat &result, int first_row, int begin, int end,
+		const peak_query &q, std::vector<match_candidate> &pool)
+{
+	if (best_only(q)) {
+		double max_val = 0.0;
+		cv::Point max_loc;
+		cv::minMaxLoc(result(cv::Rect(0, begin, result.cols, end - begin)), nullptr, &max_val,
+				nullptr, &max_loc);
+		if (max_val >= q.min_score) {
+			pool.push_back({max_loc.x, first_row + begin + max_loc.y, static_cast<float>(max_val)});
+		}
+		return;
+	}
+
+	const size_t pool_size = peak_pool_size(q);
+	for (int ry = begin; ry < end; ++ry) {
+		const float *above = ry > 0 ? result.ptr<float>(ry - 1) : nullptr;
+		const float *row = result.ptr<float>(ry);
+		const float *below = ry + 1 < result.rows ? result.ptr<float>(ry + 1) : nullptr;
+		for (int x = 0; x < result.cols; ++x) {
+			const float score = row[x];
+			if (!std::isfinite(score) || score < q.min_score) {
+				continue;
+			}
+
+			/* NaN neighbours compare false and never outrank a peak. */
+			const int x0 = std::max(x - 1, 0);
+			const int x1 = std::min(x + 1, result.cols - 1);
+			bool peak = true;
+			for (int nx = x0; nx <= x1 && peak; ++nx) {
+				peak = !(above && above[nx] > score) && !(below && below[nx] > score) &&
+						!(row[nx] > score);
+			}
+			if (!peak) {
+				continue;
+			}
+
+			pool.push_back({x, first_row + ry, score});
+			if (pool.size() >= 2 * pool_size) {
+				trim_peaks(pool, pool_size);
+			}
+		}
+	}
+}
+
+/* Sets out to the peaks of pool that survive q's suppression, strongest
+ * first. Where the peaks come from, and in what order, does not matter. */
+static void suppress_peaks(std::vector<match_candidate> &pool, const peak_query &q,
+		std::vector<match_candidate> &out)
+{
+	std::sort(pool.begin(), pool.end(), stronger_peak);
+	out.clear();
+	for (const match_candidate &cand : pool) {
+		if (out.size() == q.count) {
+			break;
+		}
+		const bool suppressed = std::any_of(out.begin(), out.end(), [&](const match_candidate &kept) {
+			return std::abs(kept.x - cand.x) < q.min_dx && std::abs(kept.y - cand.y) < q.min_dy;
+		});
+		if (!suppressed) {
+			out.push_back(cand);
+		}
+	}
+}
+
+/* Sets out to the peaks of a whole result map. */
+static void reduce_result(match_workspace *ws, const cv::Mat &result, const peak_query &q,
+		std::vector<match_candidate> &out)
+{
+	ws->peak_pool.clear();
+	collect_peaks(result, 0, 0, result.rows, q, ws->peak_pool);
+	suppress_peaks(ws->peak_pool, q, out);
+}
+
+/* View of `buffer` sized for matching templ_size over frame_size. The
+ * buffer only grows, so matchTemplate finds its output already allocated
+ * and writes into it in place. */
+static cv::Mat result_view(cv::Mat &buffer, const cv::Size &frame_size, const cv::Size &templ_size)
+{
+	const int rows = frame_size.height - templ_size.height + 1;
+	const int cols = frame_size.width - templ_size.width + 1;
+	if (buffer.rows < rows || buffer.cols < cols) {
+		buffer.create(std::max(buffer.rows, rows), std::max(buffer.cols, cols), CV_32F);
+	}
+	return buffer(cv::Rect(0, 0, cols, rows));
+}
+
+/* Spatial TM_CCOEFF_NORMED map of templ over the frame rows that result
+ * rows [first, first + count) read, into a view of buffer. */
+static cv::Mat match_band(cv::Mat &buffer, const cv::Mat &frame, const cv::Mat &templ,
+		const cv::Mat &mask, int first, int count)
+{
+	const cv::Mat frame_band = frame(cv::Rect(0, first, frame.cols, count + templ.rows - 1));
+	cv::Mat band = result_view(buffer, frame_band.size(), templ.size());
+	if (mask.empty()) {
+		cv::matchTemplate(frame_band, templ, band, cv::TM_CCOEFF_NORMED);
+	} else {
+		cv::matchTemplate(frame_band, templ, band, cv::TM_CCOEFF_NORMED, mask);
+	}
+	return band;
+}
+
+/* One tiled scan handed to the tile pool. */
+struct tile_scan {
+	match_workspace *ws;
+	const cv::Mat *frame;
+	const cv::Mat *templ;
+	const cv::Mat *mask;
+	const peak_query *q;
+	int rows;
+	int tile_rows;
+};
+
+/* Matches result rows [first, first + count) of a banded search and adds
+ * their local peaks to pool. Peaks need their neighbours, so unless only
+ * the best entry is wanted the band also covers the row on either side,
+ * and bands find the same peaks the whole map would. */
+static void scan_band(cv::Mat &buffer, const cv::Mat &frame, const cv::Mat &templ,
+		const cv::Mat &mask, const peak_query &q, int rows, int first, int count,
+		std::vector<match_candidate> &pool)
+{
+	const int halo = best_only(q) ? 0 : 1;
+	const int band_first = std::max(first - halo, 0);
+	const int band_end = std::min(first + count + halo, rows);
+	const cv::Mat band = match_band(buffer, frame, templ, mask, band_first, band_end - band_first);
+	collect_peaks(band, band_first, first - band_first, first + count - band_first, q, pool);
+}
+
+static void scan_tile(void *param, size_t index, unsigned slot)
+{
+	const tile_scan *scan = static_cast<const tile_scan *>(param);
+	const int first = static_cast<int>(index) * scan->tile_rows;
+	const int count = std::min(scan->tile_rows, scan->rows - first);
+
+	scan_band(scan->ws->tile_results[slot], *scan->frame, *scan->templ, *scan->mask, *scan->q,
+			scan->rows, first, count, scan->ws->tile_peaks[index]);
+}
+
+/* Computes the spatial TM_CCOEFF_NORMED map of templ over frame and sets
+ * out to its peaks as reduce_result does. Maps up to STREAM_WHOLE_BYTES
+ * are computed in one piece; larger ones in bands of result rows, so the
+ * whole map never exists. With one thread the bands are computed one after
+ * the other into the same small workspace buffer, and the local peaks of
+ * each are collected before the next. With more, they are tiles: each is
+ * matched and has its local peaks collected on its own, on the tile pool.
+ * Either way the peaks of all bands are suppressed once, at the end, so
+ * the outcome is that of a single pass over the whole map.
+ *
+ * Banding is not free. Each band is a separate matchTemplate call over its
+ * own frame rows, so the templ.rows - 1 frame rows it shares with the next
+ * band are correlated twice, and each call sets up its own sums and
+ * transforms. A band of n result rows therefore costs about
+ * (n + templ.rows - 1) / n of its share of a whole-map call. Bands of at
+ * least STREAM_BAND_TEMPLATES template heights keep that below 1.25, and
+ * tiles of at least STREAM_TILE_TEMPLATES below 1.5. For a 4K frame and a
+ * 100-row template on 8 threads, that turns 6 tiles of 400 rows into 8 of
+ * 258, each costing about 1.4 instead of 1.25 times its rows, but all 8
+ * threads finish after 258 rows instead of 6 of them after 400. */
+static void scan_spatial(match_workspace *ws, const cv::Mat &frame, const cv::Mat &templ,
+		const cv::Mat &mask, const peak_query &q, std::vector<match_candidate> &out)
+{
+	const int rows = frame.rows - templ.rows + 1;
+	const int cols = frame.cols - templ.cols + 1;
+	if (rows <= 0 || cols <= 0) {
+		out.clear();
+		return;
+	}
+
+	const size_t bytes = static_cast<size_t>(rows) * static_cast<size_t>(cols) * sizeof(float);
+	if (bytes <= STREAM_WHOLE_BYTES) {
+		reduce_result(ws, match_band(ws->result, frame, templ, mask, 0, rows), q, out);
+		return;
+	}
+
+	/* One thread gets bands sized from the template alone. More get one
+	 * tile each where the overlap floor allows it; large templates on
+	 * small frames still get fewer tiles than threads. */
+	const int threads = static_cast<int>(std::clamp(ws->threads, 1u,
+			static_cast<unsigned>(TILE_POOL_MAX_THREADS)));
+	int tile_rows = std::max(STREAM_BAND_ROWS, STREAM_BAND_TEMPLATES * templ.rows);
+	if (threads > 1) {
+		const int split_rows = (rows + threads - 1) / threads;
+		tile_rows = std::min(tile_rows, std::max({split_rows, STREAM_BAND_ROWS,
+				STREAM_TILE_TEMPLATES * templ.rows}));
+	}
+	const size_t tiles = static_cast<size_t>((rows + tile_rows - 1) / tile_rows);
+
+	ws->peak_pool.clear();
+	if (threads == 1 || tiles == 1) {
+		for (int first = 0; first < rows; first += tile_rows) {
+			const int count = std::min(tile_rows, rows - first);
+			scan_band(ws->result, frame, templ, mask, q, rows, first, count, ws->peak_pool);
+		}
+		suppress_peaks(ws->peak_pool, q, out);
+		return;
+	}
+
+	if (ws->tile_results.size() < static_cast<size_t>(threads)) {
+		ws->tile_results.resize(threads);
+	}
+	if (ws->tile_peaks.size() < tiles) {
+		ws->tile_peaks.resize(tiles);
+	}
+	for (size_t i = 0; i < tiles; ++i) {
+		ws->tile_peaks[i].clear();
+	}
+
+	tile_scan scan = {ws, &frame, &templ, &mask, &q, rows, tile_rows};
+	ws->helper_ns += tile_pool_run(tiles, static_cast<unsigned>(threads), scan_tile, &scan);
+
+	/* Each tile kept its strongest peaks, so together they hold the
+	 * strongest of the whole map. */
+	for (size_t i = 0; i < tiles; ++i) {
+		ws->peak_pool.insert(ws->peak_pool.end(), ws->tile_peaks[i].begin(), ws->tile_peaks[i].end());
+	}
+	suppress_peaks(ws->peak_pool, q, out);
+}
+
+static void search_full(match_workspace *ws, const cv::Mat &frame_gray, const cv::Mat &templ_gray,
+		const cv::Mat &mask, match_candidate *best)
+{
+	scan_spatial(ws, frame_gray, templ_gray, mask, best_query(!mask.empty()), ws->peak);
+	*best = ws->peak.empty() ? match_candidate{0, 0, 0.0f} : ws->peak.front();
+}
+
+static const cv::Mat &variant_mask(const template_variant &variant, size_t level)
+{
+	static const cv::Mat no_mask;
+	return level < variant.mask_pyramid.size() ? variant.mask_pyramid[level] : no_mask;
+}
+
+/* Matches the template inside a small window around the candidate and moves
+ * it to the best position found there. */
+static bool refine_candidate(match_workspace *ws, const cv::Mat &frame_gray,
+		const cv::Mat &templ_gray, const cv::Mat &mask, int margin, match_candidate *cand)
+{
+	const cv::Rect window = tracking_window(cand->x, cand->y, templ_gray.size(), margin,
+			frame_gray.size());
+	if (window.empty()) {
+		return false;
+	}
+
+	match_candidate local = {0, 0, 0.0f};
+	search_full(ws, frame_gray(window), templ_gray, mask, &local);
+
+	cand->x = window.x + local.x;
+	cand->y = window.y + local.y;
+	cand->score = local.score;
+	return true;
+}
+
+/* Level 0 is a view of the frame; the levels below keep their buffers from
+ * the previous detection, which pyrDown reuses while the frame size stays
+ * the same. */
+static void build_frame_pyramid(const cv::Mat &frame_gray, size_t levels,
+		std::vector<cv::Mat> &pyramid)
+{
+	size_t count = 1;
+	if (pyramid.empty()) {
+		pyramid.emplace_back();
+	}
+	pyramid[0] = frame_gray;
+
+	while (count < levels) {
+		const cv::Mat &prev = pyramid[count - 1];
+		if (std::min((prev.cols + 1) / 2, (prev.rows + 1) / 2) < PYRAMID_MIN_TEMPLATE_SIDE) {
+			break;
+		}
+		if (pyramid.size() == count) {
+			pyramid.emplace_back();
+		}
+		cv::pyrDown(pyramid[count - 1], pyramid[count]);
+		++count;
+	}
+
+	pyramid.resize(count);
+}
+
+/* Coarsest level at which both the frame and the template pyramids exist
+ * and the template still fits, or -1 if it does not fit at all. */
+static int coarse_level(const template_variant &variant, const std::vector<cv::Mat> &frame_pyramid)
+{
+	size_t level = std::min(variant.pyramid.size(), frame_pyramid.size());
+	while (level-- > 0) {
+		const cv::Mat &templ = variant.pyramid[level];
+		const cv::Mat &frame = frame_pyramid[level];
+		if (templ.cols <= frame.cols && templ.rows <= frame.rows) {
+			return static_cast<int>(level);
+		}
+	}
+	return -1;
+}
+
+static bool use_fft(const match_workspace *ws, const cv::Mat &frame, const cv::Mat &templ)
+{
+	switch (ws->engine) {
+	case MATCH_ENGINE_SPATIAL:
+		return false;
+	case MATCH_ENGINE_FFT:
+		return true;
+	case MATCH_ENGINE_AUTO:
+	default:
+		return fft_match_preferred(frame.size(), templ.size());
+	}
+}
+
+/* Sets out to the peaks of the result map of one variant over a whole
+ * frame level, as scan_spatial does. The FFT path correlates the whole
+ * level at once, so its map is always computed and reduced in one piece.
+ * Masked templates always take the spatial path, which is the only one
+ * supporting masks. */
+static void scan_frame_level(match_workspace *ws, const template_bank &bank, size_t index,
+		const cv::Mat &frame, int level, const peak_query &q, std::vector<match_candidate> &out)
+{
+	const template_variant &variant = bank.variants[index];
+	const cv::Mat &templ = variant.pyramid[level];
+	const cv::Mat &mask = variant_mask(variant, level);
+
+	if (mask.empty() && use_fft(ws, frame, templ)) {
+		cv::Mat result = result_view(ws->result, frame.size(), templ.size());
+		const fft_template_key key = {bank.generation, index, static_cast<size_t>(level)};
+		fft_match_template(&ws->fft, key, frame, templ, result);
+		reduce_result(ws, result, q, out);
+		return;
+	}
+
+	scan_spatial(ws, frame, templ, mask, q, out);
+}
+
+static void search_coarse(match_workspace *ws, const template_bank &bank, size_t index,
+		const std::vector<cv::Mat> &frame_pyramid, variant_search *state)
+{
+	const template_variant &variant = bank.variants[index];
+
+	state->searched = true;
+	state->level = coarse_level(variant, frame_pyramid);
+	state->candidates.clear();
+
+	if (state->level < 0) {
+		return;
+	}
+
+	const cv::Mat &templ = variant.pyramid[state->level];
+	const bool masked = !variant_mask(variant, state->level).empty();
+	const cv::Mat &frame = frame_pyramid[state->level];
+
+	if (state->level == 0) {
+		scan_frame_level(ws, bank, index, frame, 0, best_query(masked), state->candidates);
+		if (state->candidates.empty()) {
+			state->candidates.push_back({0, 0, 0.0f});
+		}
+		return;
+	}
+
+	const peak_query q = {PYRAMID_CANDIDATES, std::max(1, templ.cols / 2),
+			std::max(1, templ.rows / 2), -std::numeric_limits<float>::infinity(), masked};
+	scan_frame_level(ws, bank, index, frame, state->level, q, state->candidates);
+}
+
+/* Refines candidates found at `from_level` down to full resolution,
+ * dropping those that no longer fit in the frame. */
+static void refine_candidates(match_workspace *ws, const template_variant &variant,
+		const std::vector<cv::Mat> &frame_pyramid, int from_level,
+		std::vector<match_candidate> &candidates)
+{
+	for (int level = from_level; level-- > 0;) {
+		for (auto it = candidates.begin(); it != candidates.end();) {
+			it->x *= 2;
+			it->y *= 2;
+			if (refine_candidate(ws, frame_pyramid[level], variant.pyramid[level],
+					variant_mask(variant, level), PYRAMID_REFINE_MARGIN, &*it)) {
+				++it;
+			} else {
+				it = candidates.erase(it);
+			}
+		}
+	}
+}
+
+/* Refines the coarse candidates of one variant down to full resolution. */
+static bool search_descend(match_workspace *ws, const template_variant &variant,
+		const std::vector<cv::Mat> &frame_pyramid, variant_search *state, match_candidate *best)
+{
+	std::vector<match_candidate> &candidates = state->candidates;
+	refine_candidates(ws, variant, frame_pyramid, state->level, candidates);
+
+	if (candidates.empty()) {
+		return false;
+	}
+
+	*best = *std::max_element(candidates.begin(), candidates.end(),
+			[](const match_candidate &a, const match_candidate &b) {
+				return a.score < b.score;
+			});
+	return true;
+}
+
+cv::Rect tracking_window(int x, int y, const cv::Size &templ_size, int margin,
+		const cv::Size &frame_size)
+{
+	cv::Rect window(x - margin, y - margin,
+			templ_size.width + 2 * margin, templ_size.height + 2 * margin);
+	window &= cv::Rect(0, 0, frame_size.width, frame_size.height);
+
+	if (window.width < templ_size.width || window.height < templ_size.height) {
+		return cv::Rect();
+	}
+
+	return window;
+}
+
+static bool report_match(const match_candidate &best, size_t variant_index, float threshold,
+		template_match *out)
+{
+	if (out) {
+		out->score = best.score;
+	}
+
+	if (best.score >= threshold) {
+		if (out) {
+			out->x = best.x;
+			out->y = best.y;
+			out->variant_index = variant_index;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+/* Indices 0, stride, 2 * stride, ... plus the last one. */
+static void sparse_indices(size_t count, size_t stride, std::vector<size_t> &out)
+{
+	out.clear();
+	for (size_t i = 0; i < count; i += stride) {
+		out.push_back(i);
+	}
+	if (!out.empty() && out.back() != count - 1) {
+		out.push_back(count - 1);
+	}
+}
+
+/* Calls visit(index) for every variant within `radius` scale steps and
+ * `radius` angle steps of the given one. */
+template<typename Visit>
+static void for_each_neighbour(const template_bank &bank, size_t variant_index,
+		size_t scale_radius, size_t angle_radius, Visit visit)
+{
+	const size_t scale_index = variant_index / bank.angle_count;
+	const size_t angle_index = variant_index % bank.angle_count;
+
+	const size_t scale_first = scale_index > scale_radius ? scale_index - scale_radius : 0;
+	const size_t scale_last = std::min(bank.scale_count() - 1, scale_index + scale_radius);
+	const size_t angle_first = angle_index > angle_radius ? angle_index - angle_radius : 0;
+	const size_t angle_last = std::min(bank.angle_count - 1, angle_index + angle_radius);
+
+	for (size_t s = scale_first; s <= scale_last; ++s) {
+		for (size_t a = angle_first; a <= angle_last; ++a) {
+			visit(s * bank.angle_count + a);
+		}
+	}
+}
+
+bool detect_template_window(match_workspace *ws, const cv::Mat &window_gray,
+		const cv::Rect &window, const template_bank &bank, size_t variant_index,
+		float threshold, template_match *out)
+{
+	if (window_gray.empty() || variant_index >= bank.size()) {
+		return false;
+	}
+
+	match_candidate best = {0, 0, -std::numeric_limits<float>::infinity()};
+	size_t best_index = bank.size();
+
+	for_each_neighbour(bank, variant_index, 1, 1, [&](size_t i) {
+		const template_variant &variant = bank.variants[i];
+		const cv::Mat &templ = variant.pyramid[0];
+		if (templ.cols > window_gray.cols || templ.rows > window_gray.rows) {
+			return;
+		}
+
+		match_candidate cand = {0, 0, 0.0f};
+		search_full(ws, window_gray, templ, variant_mask(variant, 0), &cand);
+		if (cand.score > best.score) {
+			best = cand;
+			best_index = i;
+		}
+	});
+
+	if (best_index == bank.size()) {
+		return false;
+	}
+
+	best.x += window.x;
+	best.y += window.y;
+	return report_match(best, best_index, threshold, out);
+}
+
+size_t template_bank_levels(const template_bank &bank)
+{
+	size_t levels = 0;
+	for (const template_variant &variant : bank.variants) {
+		levels = std::max(levels, variant.pyramid.size());
+	}
+	return levels;
+}
+
+void match_begin_frame(match_workspace *ws, const cv::Mat &frame_gray, size_t levels)
+{
+	fft_match_reset_frames(&ws->fft);
+	build_frame_pyramid(frame_gray, std::max<size_t>(levels, 1), ws->frame_pyramid);
+}
+
+void match_end_frame(match_workspace *ws)
+{
+	/* Do not keep the caller's frame alive between detections. */
+	if (!ws->frame_pyramid.empty()) {
+		ws->frame_pyramid[0].release();
+	}
+	fft_match_reset_frames(&ws->fft);
+}
+
+/* Ranks the bank's variants at their coarsest level: a sparse grid of
+ * scales and angles first, then the scales around the winner at its angle
+ * and the angles around it at its scale. Returns the winner, whose state
+ * holds its coarse candidates, or bank.size() if no variant fits. */
+static size_t rank_variants(match_workspace *ws, const template_bank &bank)
+{
+	const std::vector<cv::Mat> &frame_pyramid = ws->frame_pyramid;
+	std::vector<variant_search> &states = ws->states;
+	if (states.size() < bank.size()) {
+		states.resize(bank.size());
+	}
+	for (size_t i = 0; i < bank.size(); ++i) {
+		states[i].searched = false;
+		states[i].level = -1;
+		states[i].candidates.clear();
+	}
+
+	size_t winner = bank.size();
+	float winner_score = -std::numeric_limits<float>::infinity();
+
+	auto rank = [&](size_t i) {
+		variant_search &state = states[i];
+		if (!state.searched) {
+			search_coarse(ws, bank, i, frame_pyramid, &state);
+		}
+		if (!state.candidates.empty() && state.candidates.front().score > winner_score) {
+			winner = i;
+			winner_score = state.candidates.front().score;
+		}
+	};
+
+	std::vector<size_t> &scale_steps = ws->scale_steps;
+	std::vector<size_t> &angle_steps = ws->angle_steps;
+	sparse_indices(bank.scale_count(), SCALE_COARSE_STRIDE, scale_steps);
+	sparse_indices(bank.angle_count, ANGLE_COARSE_STRIDE, angle_steps);
+	for (size_t s : scale_steps) {
+		for (size_t a : angle_steps) {
+			rank(s * bank.angle_count + a);
+		}
+	}
+
+	if (winner != bank.size()) {
+		/* Refine the scale at the winning angle, then the angle at that scale. */
+		for_each_neighbour(bank, winner, SCALE_COARSE_STRIDE - 1, 0, rank);
+		for_each_neighbour(bank, winner, 0, ANGLE_COARSE_STRIDE - 1, rank);
+	}
+	return winner;
+}
+
+bool detect_template(match_workspace *ws, const template_bank &bank, float threshold,
+		template_match *out)
+{
+	const std::vector<cv::Mat> &frame_pyramid = ws->frame_pyramid;
+	if (frame_pyramid.empty() || frame_pyramid[0].empty() || bank.empty()) {
+		return false;
+	}
+
+	const size_t winner = rank_variants(ws, bank);
+	if (winner == bank.size()) {
+		return false;
+	}
+
+	match_candidate best = {0, 0, 0.0f};
+	const bool found = search_descend(ws, bank.variants[winner], frame_pyramid,
+			&ws->states[winner], &best);
+	return found && report_match(best, winner, threshold, out);
+}
+
+size_t detect_template_instances(match_workspace *ws, const template_bank &bank, float threshold,
+		size_t max_count, template_match *out)
+{
+	const std::vector<cv::Mat> &frame_pyramid = ws->frame_pyramid;
+	if (frame_pyramid.empty() || frame_pyramid[0].empty() || bank.empty() || max_count == 0) {
+		return 0;
+	}
+
+	const size_t winner = rank_variants(ws, bank);
+	if (winner == bank.size()) {
+		return 0;
+	}
+
+	/* Ranking only kept a few candidates of the winner, so its coarse map
+	 * is computed once more (from cached spectra on the FFT path) and all
+	 * of its peaks are taken in a single scan. */
+	const template_variant &variant = bank.variants[winner];
+	const int level = ws->states[winner].level;
+	const cv::Mat &templ = variant.pyramid[level];
+
+	std::vector<match_candidate> &candidates = ws->states[winner].candidates;
+	const size_t count_wanted = level > 0 ? max_count * INSTANCE_COARSE_FACTOR : max_count;
+	const float min_score = level > 0 ? threshold - INSTANCE_COARSE_SLACK : threshold;
+	const peak_query q = {count_wanted, std::max(1, templ.cols / 2), std::max(1, templ.rows / 2),
+			min_score, !variant_mask(variant, level).empty()};
+	scan_frame_level(ws, bank, winner, frame_pyramid[level], level, q, candidates);
+	refine_candidates(ws, variant, frame_pyramid, level, candidates);
+
+	/* Refinement can pull two coarse peaks onto the same copy. */
+	std::sort(candidates.begin(), candidates.end(),
+			[](const match_candidate &a, const match_candidate &b) {
+				return a.score > b.score;
+			});
+
+	const cv::Size size = variant.pyramid[0].size();
+	size_t count = 0;
+	for (const match_candidate &cand : candidates) {
+		if (count == max_count || cand.score < threshold) {
+			break;
+		}
+
+		const bool suppressed = std::any_of(out, out + count, [&](const template_match &kept) {
+			return std::abs(kept.x - cand.x) < std::max(1, size.width / 2) &&
+					std::abs(kept.y - cand.y) < std::max(1, size.height / 2);
+		});
+		if (!suppressed) {
+			out[count++] = {cand.x, cand.y, cand.score, winner};
+		}
+	}
+	return count;
+}
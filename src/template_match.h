@@ -0,0 +1,176 @@
+#pragma once
+
+#include "fft_match.h"
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* One entry of the template bank: the template resized by `scale`, rotated
+ * by `angle` degrees, and its coarse-to-fine pyramid. pyramid[0] is the
+ * variant itself; each further level is a cv::pyrDown of the previous one.
+ * Rotated variants grow to fit the rotated corners and carry a mask pyramid
+ * that excludes them; unrotated variants have no mask. */
+struct template_variant {
+	float scale;
+	float angle;
+	cv::Size base_size;
+	cv::Point2f origin;
+	std::vector<cv::Mat> pyramid;
+	std::vector<cv::Mat> mask_pyramid;
+};
+
+/* Variants are stored scale-major: index = scale_index * angle_count +
+ * angle_index. generation is unique per build and keys derived caches.
+ * The bank matches frames shrunk by `downscale`, and all variant geometry
+ * is in those detection pixels. */
+struct template_bank {
+	std::vector<template_variant> variants;
+	size_t angle_count = 1;
+	int downscale = 1;
+	uint64_t generation = 0;
+
+	bool empty() const { return variants.empty(); }
+	size_t size() const { return variants.size(); }
+	size_t scale_count() const { return variants.size() / angle_count; }
+};
+
+enum match_engine {
+	MATCH_ENGINE_AUTO,
+	MATCH_ENGINE_SPATIAL,
+	MATCH_ENGINE_FFT,
+};
+
+struct match_candidate {
+	int x;
+	int y;
+	float score;
+};
+
+/* Per-variant state of one detection: the pyramid level the variant was
+ * ranked at and its best candidates there, strongest first. */
+struct variant_search {
+	bool searched = false;
+	int level = -1;
+	std::vector<match_candidate> candidates;
+};
+
+/* Detection state kept between calls. Owned by the caller and used by one
+ * detection at a time. The scratch buffers keep their memory from one
+ * detection to the next and are only reallocated when the resolution or
+ * the template bank changes. OpenCV still allocates its own temporaries
+ * inside matchTemplate, pyrDown, dft and integral on every call. */
+struct match_workspace {
+	match_engine engine = MATCH_ENGINE_AUTO;
+	fft_match_cache fft;
+
+	/* Threads a large spatial search may be split across, counting the
+	 * caller's; the others come from the tile pool. helper_ns adds up the
+	 * time they spent on this workspace's searches; the caller resets it. */
+	unsigned threads = 1;
+	uint64_t helper_ns = 0;
+
+	/* Frame pyramid; level 0 refers to the frame only during a detection. */
+	std::vector<cv::Mat> frame_pyramid;
+	/* Result maps, or bands of large spatial ones, are views of its
+	 * top-left corner. Only ever grows. */
+	cv::Mat result;
+	std::vector<variant_search> states;
+	std::vector<match_candidate> peak;
+	/* Local peaks of a search awaiting suppression. */
+	std::vector<match_candidate> peak_pool;
+	/* Tiled searches: a result buffer per thread slot and the local peaks
+	 * of each tile. */
+	std::vector<cv::Mat> tile_results;
+	std::vector<std::vector<match_candidate>> tile_peaks;
+	std::vector<size_t> scale_steps;
+	std::vector<size_t> angle_steps;
+};
+
+struct template_match {
+	int x;
+	int y;
+	float score;
+	size_t variant_index;
+};
+
+/* Precomputes templates for every scale from scale_min to scale_max in
+ * scale_step increments, times every angle from -angle_range to angle_range
+ * in angle_step increments, each with up to pyramid_levels downsampled
+ * levels. Both ranges are covered from end to end; steps too fine for the
+ * bank's size limits are widened, see template_scale_step. With a downscale above 1 the template is first shrunk by that
+ * factor to match frames shrunk the same way. A 1:1, unrotated, full
+ * resolution range yields a single variant holding templ_gray unchanged. */
+void build_template_bank(const cv::Mat &templ_gray, float scale_min, float scale_max,
+		float scale_step, float angle_range, float angle_step, int pyramid_levels,
+		int downscale, template_bank &out_bank);
+
+/* Scale step build_template_bank actually uses for the range: scale_step,
+ * raised to the smallest step supported and widened if the range would
+ * otherwise need more variants than a bank holds. The range always runs
+ * from scale_min to scale_max. */
+float template_scale_step(float scale_min, float scale_max, float scale_step);
+
+/* Same for angles: the range always runs from -angle_range to angle_range,
+ * so the bank stays symmetric. */
+float template_angle_step(float angle_range, float angle_step);
+
+/* Rotates src by angle degrees (counter-clockwise) about pivot, growing the
+ * canvas so nothing is cropped. Pixels outside src become zero. origin
+ * receives the top-left of the new canvas in the coordinates of src, so two
+ * images rotated about the same pivot stay aligned. */
+void rotate_image(const cv::Mat &src, const cv::Point2f &pivot, float angle, int interpolation,
+		cv::Mat &dst, cv::Point2f *origin);
+
+/* Pyramid levels a frame needs for searching this bank. */
+size_t template_bank_levels(const template_bank &bank);
+
+/* Prepares a frame for any number of detect_template calls: its pyramid
+ * down to `levels` levels is built once and, on the FFT path, its spectrum
+ * and window sums are computed once per level on first use. The frame must
+ * stay unchanged until match_end_frame, which drops the workspace's
+ * reference to it. */
+void match_begin_frame(match_workspace *ws, const cv::Mat &frame_gray, size_t levels);
+void match_end_frame(match_workspace *ws);
+
+/* Finds the best TM_CCOEFF_NORMED match of any bank variant in the frame
+ * prepared by match_begin_frame.
+ * Variants are ranked at their coarsest pyramid level: a sparse grid of
+ * scales and angles first, then the neighbouring scales of the winner and
+ * the neighbouring angles of that, so only one variant pays for the full
+ * coarse-to-fine descent. The reported position and score come from the
+ * full-resolution template of the winning variant. out->score is always
+ * set; the position and variant only when the score reaches the threshold.
+ *
+ * Whole-frame searches of unmasked templates use the engine selected in the
+ * workspace; MATCH_ENGINE_AUTO picks the FFT path where its cost model beats
+ * the spatial one. Large spatial searches are split into horizontal tiles
+ * across the workspace's threads. */
+bool detect_template(match_workspace *ws, const template_bank &bank, float threshold,
+		template_match *out);
+
+/* Finds up to max_count separate copies of the bank in the frame prepared
+ * by match_begin_frame, each scoring at least threshold, strongest first.
+ * The variant is picked as in detect_template and used for every copy:
+ * the local peaks of its coarsest result map are collected in one scan,
+ * taken strongest first, skipping any within half the template size of
+ * one already kept, and refined to full resolution. A peak is only ever
+ * dropped for a stronger one that was kept. out must have room for
+ * max_count matches; returns how many were found. */
+size_t detect_template_instances(match_workspace *ws, const template_bank &bank, float threshold,
+		size_t max_count, template_match *out);
+
+/* Window of +-margin pixels around a previous match whose top-left corner
+ * was at (x, y), clamped to the frame. Empty if the template no longer fits. */
+cv::Rect tracking_window(int x, int y, const cv::Size &templ_size, int margin,
+		const cv::Size &frame_size);
+
+/* Full-resolution search restricted to a window of the frame, trying the
+ * given variant and its immediate scale and angle neighbours. window_gray
+ * holds the gray pixels of `window` only; the position is reported in frame
+ * coordinates. */
+bool detect_template_window(match_workspace *ws, const cv::Mat &window_gray,
+		const cv::Rect &window, const template_bank &bank, size_t variant_index,
+		float threshold, template_match *out);
@@ -0,0 +1,158 @@
+#include "tile_pool.h"
+
+#include <util/platform.h>
+#include <util/threading.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* One tile_pool_run call. Lives on the caller's stack; the caller takes it
+ * off the list once every index is claimed and waits for the pool threads
+ * still running its tasks. */
+struct tile_batch {
+	tile_task task;
+	void *param;
+	size_t count;
+	std::atomic<size_t> next{0};
+
+	/* Guarded by the pool mutex. */
+	unsigned helpers_left;
+	unsigned next_slot = 1;
+	unsigned running = 0;
+	uint64_t helper_ns = 0;
+};
+
+struct tile_pool {
+	std::mutex mutex;
+	std::condition_variable work;
+	std::condition_variable finished;
+	std::vector<std::thread> threads;
+
+	bool stop = false;
+	std::vector<tile_batch *> batches;
+};
+
+static tile_pool *pool = nullptr;
+
+/* Runs tasks of the batch until no index is left. */
+static void drain(tile_batch *batch, unsigned slot)
+{
+	for (;;) {
+		const size_t index = batch->next.fetch_add(1, std::memory_order_relaxed);
+		if (index >= batch->count) {
+			break;
+		}
+		batch->task(batch->param, index, slot);
+	}
+}
+
+/* First batch that still has unclaimed indices and room for a helper.
+ * Called with the pool locked. */
+static tile_batch *open_batch(tile_pool *tp)
+{
+	for (tile_batch *batch : tp->batches) {
+		if (batch->helpers_left > 0 &&
+				batch->next.load(std::memory_order_relaxed) < batch->count) {
+			return batch;
+		}
+	}
+	return nullptr;
+}
+
+static void pool_thread(tile_pool *tp)
+{
+	os_set_thread_name("shape-overlay: tiles");
+
+	std::unique_lock<std::mutex> lock(tp->mutex);
+
+	for (;;) {
+		tile_batch *batch = nullptr;
+		tp->work.wait(lock, [tp, &batch] {
+			batch = open_batch(tp);
+			return tp->stop || batch;
+		});
+		if (tp->stop) {
+			break;
+		}
+
+		--batch->helpers_left;
+		++batch->running;
+		const unsigned slot = batch->next_slot++;
+		lock.unlock();
+
+		const uint64_t start_ts = os_gettime_ns();
+		drain(batch, slot);
+		const uint64_t elapsed_ns = os_gettime_ns() - start_ts;
+
+		lock.lock();
+		batch->helper_ns += elapsed_ns;
+		--batch->running;
+		tp->finished.notify_all();
+	}
+}
+
+void tile_pool_start(void)
+{
+	if (pool) {
+		return;
+	}
+
+	const unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+	const unsigned count = std::min(cores, static_cast<unsigned>(TILE_POOL_MAX_THREADS)) - 1;
+
+	pool = new tile_pool();
+	for (unsigned i = 0; i < count; ++i) {
+		pool->threads.emplace_back(pool_thread, pool);
+	}
+}
+
+void tile_pool_stop(void)
+{
+	if (!pool) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->stop = true;
+	}
+	pool->work.notify_all();
+
+	for (std::thread &thread : pool->threads) {
+		thread.join();
+	}
+	delete pool;
+	pool = nullptr;
+}
+
+uint64_t tile_pool_run(size_t count, unsigned threads, tile_task task, void *param)
+{
+	tile_batch batch;
+	batch.task = task;
+	batch.param = param;
+	batch.count = count;
+	batch.helpers_left = std::min<size_t>(threads > 1 ? threads - 1 : 0,
+			count > 1 ? count - 1 : 0);
+
+	if (!pool || pool->threads.empty() || batch.helpers_left == 0) {
+		drain(&batch, 0);
+		return 0;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->batches.push_back(&batch);
+	}
+	pool->work.notify_all();
+
+	drain(&batch, 0);
+
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->batches.erase(std::find(pool->batches.begin(), pool->batches.end(), &batch));
+	pool->finished.wait(lock, [&batch] { return batch.running == 0; });
+	return batch.helper_ns;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* Plugin-wide threads that help a detection search a large frame tile by
+ * tile, shared by every detection in flight. Started and stopped along
+ * with the detection scheduler. The pool has one thread less than the
+ * cores it may use (at most TILE_POOL_MAX_THREADS in total), since the
+ * detection itself always takes part. */
+#define TILE_POOL_MAX_THREADS 8
+
+void tile_pool_start(void);
+void tile_pool_stop(void);
+
+/* Runs task(param, index, slot) for every index in [0, count) on up to
+ * `threads` threads: the caller's and up to threads - 1 pool threads that
+ * are free, each taking the next index until none are left. slot is
+ * unique among the threads running the tasks at the same time, 0 for the
+ * caller and below `threads` for the others, so tasks can keep per-thread
+ * scratch. Returns once every task has finished, with the time pool
+ * threads spent on them in nanoseconds. Without a running pool everything
+ * runs on the caller's thread. */
+typedef void (*tile_task)(void *param, size_t index, unsigned slot);
+
+uint64_t tile_pool_run(size_t count, unsigned threads, tile_task task, void *param);
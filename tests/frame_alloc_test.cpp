@@ -0,0 +1,204 @@
+/* Checks that the video thread's part of a frame does not allocate once it
+ * has seen one frame of a given size: the grayscale snapshot extracted into
+ * a view of the filter's gray buffer, and the overlay blends into the frame.
+ * Counts calls to a replaced global operator new while running the same
+ * frame twice and fails if the second pass makes any.
+ * Needs only OpenCV core; returns nonzero on any allocation. */
+
+#include "frame_luma.h"
+#include "overlay_blend.h"
+#include "overlay_yuv.h"
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+	++allocations;
+	if (void *p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+	++allocations;
+	if (void *p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	std::free(p);
+}
+
+static constexpr int FRAME_W = 1280;
+static constexpr int FRAME_H = 720;
+
+static std::mt19937 rng(12345);
+
+static cv::Mat random_mat(int w, int h, int type)
+{
+	cv::Mat m(h, w, type);
+	std::uniform_int_distribution<int> byte(0, 255);
+	const size_t row_bytes = static_cast<size_t>(w) * m.elemSize();
+	for (int y = 0; y < h; ++y) {
+		uint8_t *row = m.ptr<uint8_t>(y);
+		for (size_t i = 0; i < row_bytes; ++i) {
+			row[i] = static_cast<uint8_t>(byte(rng));
+		}
+	}
+	return m;
+}
+
+/* What the filter keeps between frames. */
+struct frame_state {
+	cv::Mat bgra;
+	cv::Mat luma8;
+	cv::Mat packed;
+	cv::Mat luma16;
+	cv::Mat nv12_y;
+	cv::Mat nv12_uv;
+
+	cv::Mat gray_frame;
+	luma_scratch luma;
+
+	prepared_overlay overlay;
+	prepared_plane overlay_luma;
+	yuv_overlay overlay_yuv;
+};
+
+/* One frame's worth of extraction at every downscale factor, full frame
+ * and tracking window, then every blend at both parities. */
+static bool run_frame(frame_state &s)
+{
+	static const cv::Point positions[] = {{-20, -10}, {101, 57}, {640, 333}, {1240, 700}};
+	static constexpr size_t position_count = sizeof(positions) / sizeof(positions[0]);
+
+	const uint8_t *gray_data = s.gray_frame.data;
+
+	for (int factor = 1; factor <= 4; factor *= 2) {
+		const int w = FRAME_W / factor;
+		const int h = FRAME_H / factor;
+		const cv::Rect regions[] = {cv::Rect(0, 0, w, h), cv::Rect(w / 3, h / 4, w / 3, h / 2)};
+		for (const cv::Rect &region : regions) {
+			cv::Mat gray = s.gray_frame(cv::Rect(0, 0, region.width, region.height));
+			extract_gray_bgra(s.bgra.data, static_cast<uint32_t>(s.bgra.step), false, factor,
+					region, &s.luma, gray);
+			extract_gray_bgra(s.bgra.data, static_cast<uint32_t>(s.bgra.step), true, factor,
+					region, &s.luma, gray);
+			extract_luma8(s.luma8.data, static_cast<uint32_t>(s.luma8.step), factor,
+					region, &s.luma, gray);
+			extract_packed_luma(s.packed.data, static_cast<uint32_t>(s.packed.step), 1, factor,
+					region, &s.luma, gray);
+			extract_luma16(s.luma16.data, static_cast<uint32_t>(s.luma16.step), 8, factor,
+					region, &s.luma, gray);
+			if (gray.data != gray_data) {
+				return false;
+			}
+		}
+	}
+
+	blend_overlay_bgra(s.bgra.data, static_cast<uint32_t>(s.bgra.step), FRAME_W, FRAME_H,
+			s.overlay, positions[1].x, positions[1].y);
+	blend_overlay_bgra(s.bgra.data, static_cast<uint32_t>(s.bgra.step), FRAME_W, FRAME_H,
+			s.overlay, positions, position_count);
+	blend_overlay_plane(s.luma8.data, static_cast<uint32_t>(s.luma8.step), 1, FRAME_W, FRAME_H,
+			s.overlay_luma, positions[2].x, positions[2].y);
+	blend_overlay_plane(s.luma8.data, static_cast<uint32_t>(s.luma8.step), 1, FRAME_W, FRAME_H,
+			s.overlay_luma, positions, position_count);
+
+	uint8_t *const planes[] = {s.nv12_y.data, s.nv12_uv.data};
+	const uint32_t linesize[] = {static_cast<uint32_t>(s.nv12_y.step),
+			static_cast<uint32_t>(s.nv12_uv.step)};
+	blend_overlay_yuv(planes, linesize, FRAME_W, FRAME_H, s.overlay_yuv,
+			positions[3].x, positions[3].y);
+	blend_overlay_yuv(planes, linesize, FRAME_W, FRAME_H, s.overlay_yuv,
+			positions, position_count);
+	return true;
+}
+
+int main(void)
+{
+	frame_state s;
+	s.bgra = random_mat(FRAME_W, FRAME_H, CV_8UC4);
+	s.luma8 = random_mat(FRAME_W, FRAME_H, CV_8UC1);
+	s.packed = random_mat(FRAME_W * 2, FRAME_H, CV_8UC1);
+	s.luma16 = random_mat(FRAME_W, FRAME_H, CV_16UC1);
+	s.nv12_y = random_mat(FRAME_W, FRAME_H, CV_8UC1);
+	s.nv12_uv = random_mat(FRAME_W, FRAME_H / 2, CV_8UC1);
+	s.gray_frame.create(FRAME_H, FRAME_W, CV_8UC1);
+
+	/* A translucent-edged disc, so blends have opaque and partial spans. */
+	cv::Mat overlay = random_mat(96, 72, CV_8UC4);
+	for (int y = 0; y < overlay.rows; ++y) {
+		for (int x = 0; x < overlay.cols; ++x) {
+			const int dx = x - overlay.cols / 2;
+			const int dy = y - overlay.rows / 2;
+			const int d2 = dx * dx + dy * dy;
+			overlay.ptr<uint8_t>(y)[x * 4 + 3] = d2 < 900 ? 255 : d2 < 1200 ? 128 : 0;
+		}
+	}
+	prepare_overlay(overlay, 0.8f, &s.overlay);
+	cv::Mat alpha;
+	overlay_alpha(overlay, 0.8f, alpha);
+	prepare_plane(random_mat(overlay.cols, overlay.rows, CV_8UC1), alpha, &s.overlay_luma);
+
+	/* BT.709 limited range, as libobs hands it over. */
+	const yuv_colorimetry nv12 = {YUV_LAYOUT_NV12,
+			{1.164384f, 0.000000f, 1.792741f, -0.972945f,
+					1.164384f, -0.213249f, -0.532909f, 0.301483f,
+					1.164384f, 2.112402f, 0.000000f, -1.133402f,
+					0.000000f, 0.000000f, 0.000000f, 1.000000f},
+			false};
+	if (!convert_overlay_yuv(overlay, 0.8f, nv12, &s.overlay_yuv)) {
+		std::fprintf(stderr, "convert_overlay_yuv failed\n");
+		return 1;
+	}
+
+	/* The first frame may grow scratch buffers and build chroma phases. */
+	if (!run_frame(s)) {
+		std::fprintf(stderr, "extraction replaced the gray buffer\n");
+		return 1;
+	}
+
+	allocations = 0;
+	const bool same_buffer = run_frame(s);
+	const size_t second = allocations;
+
+	if (!same_buffer) {
+		std::fprintf(stderr, "extraction replaced the gray buffer\n");
+		return 1;
+	}
+	if (second > 0) {
+		std::fprintf(stderr, "%zu allocations on the second frame\n", second);
+		return 1;
+	}
+	std::printf("the second frame made no allocations\n");
+	return 0;
+}
@@ -0,0 +1,366 @@
+/* Checks every SIMD row kernel, and the span-based overlay and plane
+ * blends built on them, byte for byte against the per-pixel blend the
+ * filter used before them.
+ * Needs only OpenCV core; returns nonzero on the first mismatch. */
+
+#include "overlay_blend.h"
+#include "overlay_blend_kernels.h"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static std::mt19937 rng(12345);
+
+static int random_int(int lo, int hi)
+{
+	return std::uniform_int_distribution<int>(lo, hi)(rng);
+}
+
+/* The original blend_overlay_bgra loop, kept verbatim as the reference. */
+static void reference_blend_bgra(uint8_t *dst, uint32_t dst_linesize,
+		int frame_w, int frame_h, const cv::Mat &overlay,
+		int dst_x, int dst_y, float opacity)
+{
+	if (overlay.empty()) {
+		return;
+	}
+
+	const int overlay_w = overlay.cols;
+	const int overlay_h = overlay.rows;
+
+	int start_x = std::max(0, dst_x);
+	int start_y = std::max(0, dst_y);
+	int end_x = std::min(frame_w, dst_x + overlay_w);
+	int end_y = std::min(frame_h, dst_y + overlay_h);
+
+	if (start_x >= end_x || start_y >= end_y) {
+		return;
+	}
+
+	const int overlay_x0 = start_x - dst_x;
+	const int overlay_y0 = start_y - dst_y;
+
+	for (int oy = overlay_y0, fy = start_y; fy < end_y; ++fy, ++oy) {
+		const uint8_t *src_row = overlay.ptr<uint8_t>(oy);
+		uint8_t *dst_row = dst + (static_cast<size_t>(fy) * dst_linesize);
+
+		for (int ox = overlay_x0, fx = start_x; fx < end_x; ++fx, ++ox) {
+			const uint8_t *src_px = src_row + (static_cast<size_t>(ox) * 4u);
+			uint8_t *dst_px = dst_row + (static_cast<size_t>(fx) * 4u);
+
+			const int src_alpha = static_cast<int>(static_cast<float>(src_px[3]) * opacity + 0.5f);
+			if (src_alpha <= 0) {
+				continue;
+			}
+
+			const int inv_alpha = 255 - src_alpha;
+			dst_px[0] = static_cast<uint8_t>((src_px[0] * src_alpha + dst_px[0] * inv_alpha + 127) / 255);
+			dst_px[1] = static_cast<uint8_t>((src_px[1] * src_alpha + dst_px[1] * inv_alpha + 127) / 255);
+			dst_px[2] = static_cast<uint8_t>((src_px[2] * src_alpha + dst_px[2] * inv_alpha + 127) / 255);
+			dst_px[3] = 255;
+		}
+	}
+}
+
+/* Per-pixel reference for prepared planes: each value channel blended by
+ * the plane's effective alpha, other bytes of the pixel left alone. */
+template<typename T>
+static void reference_blend_plane(uint8_t *dst, uint32_t dst_linesize, int dst_step,
+		int plane_w, int plane_h, const cv::Mat &values, const cv::Mat &alpha,
+		int dst_x, int dst_y)
+{
+	const int channels = values.channels();
+	for (int oy = 0; oy < values.rows; ++oy) {
+		const int fy = dst_y + oy;
+		if (fy < 0 || fy >= plane_h) {
+			continue;
+		}
+		for (int ox = 0; ox < values.cols; ++ox) {
+			const int fx = dst_x + ox;
+			const uint32_t a = alpha.at<uint8_t>(oy, ox);
+			if (fx < 0 || fx >= plane_w || a == 0) {
+				continue;
+			}
+
+			const T *src = values.ptr<T>(oy) + static_cast<size_t>(ox) * channels;
+			T *samples = reinterpret_cast<T *>(dst + static_cast<size_t>(fy) * dst_linesize +
+					static_cast<size_t>(fx) * dst_step);
+			for (int c = 0; c < channels; ++c) {
+				samples[c] = static_cast<T>((src[c] * a + samples[c] * (255u - a) + 127u) / 255u);
+			}
+		}
+	}
+}
+
+/* Random BGRA overlay whose alpha mixes transparent, opaque and partial
+ * runs of random length, so spans start and end everywhere. */
+static cv::Mat random_overlay(int w, int h)
+{
+	cv::Mat overlay(h, w, CV_8UC4);
+	for (int y = 0; y < h; ++y) {
+		uint8_t *px = overlay.ptr<uint8_t>(y);
+		int run = 0;
+		int kind = 0;
+		for (int x = 0; x < w; ++x, px += 4) {
+			if (run-- <= 0) {
+				run = random_int(0, 6);
+				kind = random_int(0, 2);
+			}
+			px[0] = static_cast<uint8_t>(random_int(0, 255));
+			px[1] = static_cast<uint8_t>(random_int(0, 255));
+			px[2] = static_cast<uint8_t>(random_int(0, 255));
+			px[3] = static_cast<uint8_t>(kind == 0 ? 0 : kind == 1 ? 255 : random_int(1, 254));
+		}
+	}
+	return overlay;
+}
+
+static cv::Mat random_frame(int w, int h, int type)
+{
+	cv::Mat frame(h, w, type);
+	const size_t bytes = frame.total() * frame.elemSize();
+	for (size_t i = 0; i < bytes; ++i) {
+		frame.data[i] = static_cast<uint8_t>(random_int(0, 255));
+	}
+	return frame;
+}
+
+static bool same(const cv::Mat &a, const cv::Mat &b)
+{
+	return std::equal(a.data, a.data + a.total() * a.elemSize(), b.data);
+}
+
+/* Every edge position along one axis: fully outside, just clipped, flush,
+ * inside, and the same at the far edge. */
+static std::vector<int> edge_positions(int frame_size, int overlay_size)
+{
+	return {-overlay_size - 1, -overlay_size, -overlay_size + 1, -overlay_size / 2, -1, 0, 1,
+			(frame_size - overlay_size) / 2, frame_size - overlay_size - 1,
+			frame_size - overlay_size, frame_size - overlay_size + 1,
+			frame_size - overlay_size / 2, frame_size - 1, frame_size};
+}
+
+static int failures = 0;
+
+static void fail(const char *what, int w, int h, float opacity, int x, int y)
+{
+	if (failures++ < 10) {
+		std::fprintf(stderr, "%s: %dx%d overlay, opacity %.3f, at (%d, %d)\n", what, w, h,
+				static_cast<double>(opacity), x, y);
+	}
+}
+
+/* Kernels get partial pixels only, 0 < a < 255 after opacity, premultiplied
+ * as prepare_overlay does. Counts cover every SIMD width and tail. */
+static void test_kernel(const char *name, blend_row_fn kernel)
+{
+	for (int count = 0; count <= 67; ++count) {
+		for (int round = 0; round < 20; ++round) {
+			const float opacity = round == 0 ? 1.0f : static_cast<float>(random_int(2, 1000)) / 1000.0f;
+			std::vector<uint8_t> src(static_cast<size_t>(count) * 4u);
+			std::vector<uint16_t> premul(static_cast<size_t>(count) * 4u);
+			for (int i = 0; i < count; ++i) {
+				int src_alpha;
+				int a;
+				do {
+					src_alpha = random_int(1, 255);
+					a = static_cast<int>(static_cast<float>(src_alpha) * opacity + 0.5f);
+				} while (a <= 0 || a >= 255);
+
+				for (int c = 0; c < 3; ++c) {
+					src[i * 4 + c] = static_cast<uint8_t>(random_int(0, 255));
+					premul[i * 4 + c] = static_cast<uint16_t>(src[i * 4 + c] * a);
+				}
+				src[i * 4 + 3] = static_cast<uint8_t>(src_alpha);
+				premul[i * 4 + 3] = static_cast<uint16_t>(a);
+			}
+
+			cv::Mat expected = random_frame(count + 2, 1, CV_8UC4);
+			cv::Mat actual = expected.clone();
+
+			/* Offset by a pixel so the kernel sees unaligned rows. */
+			if (count > 0) {
+				const cv::Mat overlay(1, count, CV_8UC4, src.data());
+				reference_blend_bgra(expected.data, static_cast<uint32_t>(expected.step), count + 2,
+						1, overlay, 1, 0, opacity);
+			}
+			kernel(actual.data + 4, premul.data(), count);
+
+			if (!same(expected, actual)) {
+				fail(name, count, 1, opacity, 1, 0);
+			}
+		}
+	}
+}
+
+/* The span table of every row lists each visible pixel exactly once, in
+ * order: opaque runs where the effective alpha is 255, partial runs with
+ * the right premultiplied values elsewhere. */
+static void check_spans(const cv::Mat &overlay, float opacity, const prepared_overlay &prepared)
+{
+	cv::Mat alpha;
+	overlay_alpha(overlay, opacity, alpha);
+
+	bool ok = prepared.row_spans.size() == static_cast<size_t>(overlay.rows) + 1u;
+	for (int y = 0; ok && y < overlay.rows; ++y) {
+		const uint8_t *a = alpha.ptr<uint8_t>(y);
+		const uint8_t *px = overlay.ptr<uint8_t>(y);
+		std::vector<bool> covered(static_cast<size_t>(overlay.cols), false);
+		int prev_end = 0;
+
+		for (size_t s = prepared.row_spans[y]; ok && s < prepared.row_spans[y + 1]; ++s) {
+			const overlay_span &span = prepared.spans[s];
+			ok = span.length > 0 && span.x >= prev_end && span.x + span.length <= overlay.cols;
+			prev_end = span.x + span.length;
+
+			for (int x = span.x; ok && x < prev_end; ++x) {
+				covered[x] = true;
+				ok = a[x] != 0 && (a[x] == 255) == span.opaque;
+				if (ok && !span.opaque) {
+					const uint16_t *p = prepared.premul.data() +
+							(span.premul_offset + static_cast<size_t>(x - span.x)) * 4u;
+					ok = p[0] == px[x * 4] * a[x] && p[1] == px[x * 4 + 1] * a[x] &&
+							p[2] == px[x * 4 + 2] * a[x] && p[3] == a[x];
+				}
+			}
+		}
+
+		for (int x = 0; ok && x < overlay.cols; ++x) {
+			ok = covered[x] == (a[x] != 0);
+		}
+	}
+
+	if (!ok) {
+		fail("prepare_overlay spans", overlay.cols, overlay.rows, opacity, 0, 0);
+	}
+}
+
+static void test_bgra(void)
+{
+	const float opacities[] = {0.0f, 0.004f, 0.25f, 0.5f, 0.731f, 0.999f, 1.0f};
+
+	for (int round = 0; round < 40; ++round) {
+		const int w = random_int(1, 41);
+		const int h = random_int(1, 23);
+		const int frame_w = random_int(w, w + 37);
+		const int frame_h = random_int(h, h + 19);
+		const cv::Mat overlay = random_overlay(w, h);
+
+		for (float opacity : opacities) {
+			prepared_overlay prepared;
+			prepare_overlay(overlay, opacity, &prepared);
+			check_spans(overlay, opacity, prepared);
+
+			const cv::Mat frame = random_frame(frame_w, frame_h, CV_8UC4);
+			for (int y : edge_positions(frame_h, h)) {
+				for (int x : edge_positions(frame_w, w)) {
+					cv::Mat expected = frame.clone();
+					cv::Mat actual = frame.clone();
+
+					reference_blend_bgra(expected.data, static_cast<uint32_t>(expected.step),
+							frame_w, frame_h, overlay, x, y, opacity);
+					blend_overlay_bgra(actual.data, static_cast<uint32_t>(actual.step),
+							frame_w, frame_h, prepared, x, y);
+
+					if (!same(expected, actual)) {
+						fail("blend_overlay_bgra", w, h, opacity, x, y);
+					}
+				}
+			}
+
+			/* Several overlapping copies in one pass equal blending them
+			 * one after another. */
+			cv::Point positions[4];
+			for (cv::Point &p : positions) {
+				p = cv::Point(random_int(-w, frame_w), random_int(-h, frame_h));
+			}
+			cv::Mat expected = random_frame(frame_w, frame_h, CV_8UC4);
+			cv::Mat actual = expected.clone();
+			for (const cv::Point &p : positions) {
+				reference_blend_bgra(expected.data, static_cast<uint32_t>(expected.step),
+						frame_w, frame_h, overlay, p.x, p.y, opacity);
+			}
+			blend_overlay_bgra(actual.data, static_cast<uint32_t>(actual.step), frame_w, frame_h,
+					prepared, positions, 4);
+			if (!same(expected, actual)) {
+				fail("blend_overlay_bgra (copies)", w, h, opacity, positions[0].x, positions[0].y);
+			}
+		}
+	}
+}
+
+template<typename T>
+static void test_plane(int depth, int channels, int dst_step)
+{
+	for (int round = 0; round < 20; ++round) {
+		const int w = random_int(1, 29);
+		const int h = random_int(1, 17);
+		const int plane_w = random_int(w, w + 23);
+		const int plane_h = random_int(h, h + 13);
+		const float opacity = random_int(0, 1) ? 1.0f : static_cast<float>(random_int(1, 999)) / 1000.0f;
+
+		cv::Mat alpha;
+		overlay_alpha(random_overlay(w, h), opacity, alpha);
+		const cv::Mat values = random_frame(w, h, CV_MAKETYPE(depth, channels));
+
+		prepared_plane plane;
+		prepare_plane(values, alpha, &plane);
+
+		/* Rows of plane_w samples dst_step bytes apart. */
+		const cv::Mat frame = random_frame(plane_w * dst_step, plane_h, CV_8UC1);
+		for (int y : edge_positions(plane_h, h)) {
+			for (int x : edge_positions(plane_w, w)) {
+				cv::Mat expected = frame.clone();
+				cv::Mat actual = frame.clone();
+
+				reference_blend_plane<T>(expected.data, static_cast<uint32_t>(expected.step),
+						dst_step, plane_w, plane_h, values, alpha, x, y);
+				blend_overlay_plane(actual.data, static_cast<uint32_t>(actual.step), dst_step,
+						plane_w, plane_h, plane, x, y);
+
+				if (!same(expected, actual)) {
+					fail("blend_overlay_plane", w, h, opacity, x, y);
+				}
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	test_kernel("blend_row_scalar", blend_row_scalar);
+#if defined(SHAPE_OVERLAY_HAVE_SSE2)
+	test_kernel("blend_row_sse2", blend_row_sse2);
+#endif
+#if defined(SHAPE_OVERLAY_HAVE_AVX2)
+	if (cv::checkHardwareSupport(CV_CPU_AVX2)) {
+		test_kernel("blend_row_avx2", blend_row_avx2);
+	} else {
+		std::printf("AVX2 not supported by this CPU, skipping blend_row_avx2\n");
+	}
+#endif
+#if defined(SHAPE_OVERLAY_HAVE_NEON)
+	test_kernel("blend_row_neon", blend_row_neon);
+#endif
+
+	test_bgra();
+
+	/* Luma, NV12 chroma pairs, a packed YUY2 component, and 16-bit P010. */
+	test_plane<uint8_t>(CV_8U, 1, 1);
+	test_plane<uint8_t>(CV_8U, 2, 2);
+	test_plane<uint8_t>(CV_8U, 1, 2);
+	test_plane<uint16_t>(CV_16U, 1, 2);
+	test_plane<uint16_t>(CV_16U, 2, 4);
+
+	if (failures > 0) {
+		std::fprintf(stderr, "%d mismatches\n", failures);
+		return 1;
+	}
+	std::printf("all blends match the per-pixel reference\n");
+	return 0;
+}
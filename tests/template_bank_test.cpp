@@ -0,0 +1,108 @@
+/* Checks that template banks cover the configured scale and angle ranges
+ * from end to end, however fine the step. Returns nonzero on the first
+ * failure. */
+
+#include "template_match.h"
+
+#include <opencv2/core.hpp>
+
+#include <cstdio>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, float a, float b)
+{
+	if (!ok && failures++ < 10) {
+		std::fprintf(stderr, "%s (%g, %g)\n", what, static_cast<double>(a), static_cast<double>(b));
+	}
+}
+
+/* Distinct scales of a bank, in order. */
+static std::vector<float> bank_scales(const template_bank &bank)
+{
+	std::vector<float> scales;
+	for (size_t i = 0; i < bank.size(); i += bank.angle_count) {
+		scales.push_back(bank.variants[i].scale);
+	}
+	return scales;
+}
+
+static void test_scales(float scale_min, float scale_max, float scale_step)
+{
+	const cv::Mat templ(30, 40, CV_8UC1, cv::Scalar(128));
+	template_bank bank;
+	build_template_bank(templ, scale_min, scale_max, scale_step, 0.0f, 2.0f, 0, 1, bank);
+
+	const std::vector<float> scales = bank_scales(bank);
+	check(!scales.empty(), "no scales", scale_min, scale_max);
+	if (scales.empty()) {
+		return;
+	}
+
+	check(scales.front() == scale_min, "first scale is not scale_min", scales.front(), scale_min);
+	check(scales.back() == scale_max, "last scale is not scale_max", scales.back(), scale_max);
+	for (size_t i = 1; i < scales.size(); ++i) {
+		check(scales[i] > scales[i - 1], "scales not increasing", scales[i - 1], scales[i]);
+	}
+
+	const float step = template_scale_step(scale_min, scale_max, scale_step);
+	check(step >= scale_step, "step narrowed", step, scale_step);
+	for (size_t i = 1; i + 1 < scales.size(); ++i) {
+		const float gap = scales[i] - scales[i - 1];
+		check(gap > step * 0.999f && gap < step * 1.001f, "uneven step", gap, step);
+	}
+}
+
+/* Angles of the first scale, which every scale repeats. */
+static void test_angles(float angle_range, float angle_step)
+{
+	const cv::Mat templ(30, 40, CV_8UC1, cv::Scalar(128));
+	template_bank bank;
+	build_template_bank(templ, 1.0f, 1.0f, 0.05f, angle_range, angle_step, 0, 1, bank);
+
+	check(bank.angle_count > 1 && bank.angle_count <= bank.size(), "no angles",
+			angle_range, angle_step);
+	if (bank.angle_count <= 1 || bank.angle_count > bank.size()) {
+		return;
+	}
+
+	const size_t n = bank.angle_count;
+	check(bank.variants[0].angle == -angle_range, "first angle is not -range",
+			bank.variants[0].angle, -angle_range);
+	check(bank.variants[n - 1].angle == angle_range, "last angle is not +range",
+			bank.variants[n - 1].angle, angle_range);
+	for (size_t i = 0; i < n; ++i) {
+		const float a = bank.variants[i].angle;
+		const float b = bank.variants[n - 1 - i].angle;
+		check(a + b > -1e-3f && a + b < 1e-3f, "angles not symmetric", a, b);
+	}
+
+	const float step = template_angle_step(angle_range, angle_step);
+	check(step >= angle_step, "step narrowed", step, angle_step);
+}
+
+int main(void)
+{
+	/* The properties allow 25% to 400% in steps of 1% to 50%. */
+	test_scales(0.25f, 4.0f, 0.05f);
+	test_scales(0.25f, 4.0f, 0.01f);
+	test_scales(0.25f, 4.0f, 0.11f);
+	test_scales(0.25f, 4.0f, 0.5f);
+	test_scales(0.9f, 1.1f, 0.05f);
+	test_scales(0.5f, 0.5f, 0.05f);
+
+	/* Rotation up to 45 degrees in steps of 0.5 to 15. */
+	test_angles(45.0f, 2.0f);
+	test_angles(45.0f, 0.5f);
+	test_angles(30.0f, 2.0f);
+	test_angles(10.0f, 3.0f);
+	test_angles(0.5f, 15.0f);
+
+	if (failures > 0) {
+		std::fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+	std::printf("template banks cover their whole range\n");
+	return 0;
+}
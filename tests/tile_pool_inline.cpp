@@ -0,0 +1,13 @@
+/* Tests link the matcher without libobs, so they get this stand-in for the
+ * tile pool: what tile_pool_run does when the pool is not running. */
+
+#include "tile_pool.h"
+
+uint64_t tile_pool_run(size_t count, unsigned threads, tile_task task, void *param)
+{
+	(void)threads;
+	for (size_t i = 0; i < count; ++i) {
+		task(param, i, 0);
+	}
+	return 0;
+}